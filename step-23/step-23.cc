@@ -21,113 +21,2279 @@
 
 // We start with the usual assortment of include files that we've seen in so
 // many of the previous tests:
+#include <deal.II/base/aligned_vector.h>
 #include <deal.II/base/function.h>
+#include <deal.II/base/graph_coloring.h>
+#include <deal.II/base/memory_consumption.h>
+#include <deal.II/base/multithread_info.h>
+#include <deal.II/base/parallel.h>
+#include <deal.II/base/parameter_handler.h>
 #include <deal.II/base/quadrature_lib.h>
+#include <deal.II/base/smartpointer.h>
+#include <deal.II/base/timer.h>
+#include <deal.II/base/vectorization.h>
+#include <deal.II/base/work_stream.h>
 
 #include <deal.II/lac/affine_constraints.h>
+#include <deal.II/lac/diagonal_matrix.h>
 #include <deal.II/lac/dynamic_sparsity_pattern.h>
+#include <deal.II/lac/full_matrix.h>
+#include <deal.II/lac/lapack_full_matrix.h>
 #include <deal.II/lac/precondition.h>
 #include <deal.II/lac/solver_cg.h>
+#include <deal.II/lac/sparse_direct.h>
 #include <deal.II/lac/sparse_matrix.h>
+#include <deal.II/lac/sparse_mic.h>
 #include <deal.II/lac/vector.h>
 
 #include <deal.II/grid/grid_generator.h>
+#include <deal.II/grid/grid_tools.h>
 #include <deal.II/grid/tria.h>
 
 #include <deal.II/dofs/dof_handler.h>
+#include <deal.II/dofs/dof_renumbering.h>
 #include <deal.II/dofs/dof_tools.h>
 
 #include <deal.II/fe/fe_q.h>
 #include <deal.II/fe/fe_simplex_p.h>
+#include <deal.II/fe/fe_values.h>
 #include <deal.II/fe/mapping_fe.h>
+#include <deal.II/fe/mapping_q1.h>
+
+#include <deal.II/multigrid/mg_coarse.h>
+#include <deal.II/multigrid/mg_constrained_dofs.h>
+#include <deal.II/multigrid/mg_matrix.h>
+#include <deal.II/multigrid/mg_smoother.h>
+#include <deal.II/multigrid/mg_tools.h>
+#include <deal.II/multigrid/mg_transfer.h>
+#include <deal.II/multigrid/multigrid.h>
+
+#include <deal.II/matrix_free/fe_evaluation.h>
+#include <deal.II/matrix_free/matrix_free.h>
+
+#include <deal.II/meshworker/scratch_data.h>
 
 #include <deal.II/numerics/data_out.h>
 
-#include <fstream>
-#include <iostream>
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+
+// Here are the only three include files of some new interest: The first one
+// is already used, for example, for the
+// VectorTools::interpolate_boundary_values and
+// MatrixTools::apply_boundary_values functions. However, we here use another
+// function in that class, VectorTools::project to compute our initial values
+// as the $L^2$ projection of the continuous initial values. Furthermore, we
+// use VectorTools::create_right_hand_side to generate the integrals
+// $(f^n,\phi^n_i)$. These were previously always generated by hand in
+// <code>assemble_system</code> or similar functions in application
+// code. However, we're too lazy to do that here, so simply use a library
+// function:
+#include <deal.II/numerics/vector_tools.h>
+
+// Finally, here is an include file that contains all sorts of tool functions
+// that one sometimes needs. In particular, we need the
+// Utilities::int_to_string class that, given an integer argument, returns a
+// string representation of it. It is particularly useful since it allows for
+// a second parameter indicating the number of digits to which we want the
+// result padded with leading zeros. We will use this to write output files
+// that have the form <code>solution-XXX.vtu</code> where <code>XXX</code>
+// denotes the number of the time step and always consists of three digits
+// even if we are still in the single or double digit time steps.
+#include <deal.II/base/utilities.h>
+
+// AMR
+#include <deal.II/grid/grid_refinement.h>
+#include <deal.II/numerics/error_estimator.h>
+#include <deal.II/numerics/solution_transfer.h>
+
+#include <chrono>
+#include <deque>
+#include <memory>
+
+// The last step is as in all previous programs:
+namespace Step23 {
+using namespace dealii;
+
+// @sect3{The <code>BoundaryMaskedMatrix</code> class}
+
+// The matrix $M+k^2\theta^2A$ we have to invert for $U^n$ does not change
+// from one time step to the next; only the Dirichlet values we have to
+// impose do. MatrixTools::apply_boundary_values, however, writes into the
+// matrix it is given, which would force us to rebuild the matrix in every
+// time step. The following class instead wraps a matrix that is built once
+// per mesh and applies the boundary rows on the fly: in a matrix-vector
+// product, the entries of the source vector that correspond to boundary
+// degrees of freedom are treated as zero, and the boundary rows of the
+// result are set to the diagonal entry times the source value. This is
+// exactly the operator that MatrixTools::apply_boundary_values would have
+// produced (with column elimination), but it costs only a loop over the
+// boundary degrees of freedom instead of two passes over all nonzero
+// entries. The contributions of the eliminated columns are moved to the
+// right hand side by the apply_boundary_values() function, see
+// subtract_boundary_columns() below. It takes the boundary values as a flat
+// array ordered like the list of boundary degrees of freedom given to
+// initialize().
+template <typename MatrixType> class BoundaryMaskedMatrix {
+public:
+  using value_type = typename MatrixType::value_type;
+
+  void initialize(const MatrixType &matrix,
+                  const std::vector<types::global_dof_index> &boundary_dofs);
+
+  template <typename VectorType>
+  void vmult(VectorType &dst, const VectorType &src) const;
+
+  template <typename VectorType>
+  void apply_boundary_values(const std::vector<double> &boundary_values,
+                             VectorType &solution,
+                             VectorType &right_hand_side) const;
+
+private:
+  SmartPointer<const MatrixType> matrix;
+  std::vector<types::global_dof_index> boundary_dofs;
+  std::vector<bool> is_boundary_dof;
+  std::vector<value_type> boundary_diagonal;
+  mutable std::vector<value_type> saved_boundary_values;
+};
+
+// Moving the eliminated columns to the right hand side needs the entries
+// of the boundary columns. For matrices that give access to their rows, we
+// read them from the boundary rows instead, since all of our matrices are
+// symmetric. Matrices that only store part of each row provide an overload
+// of this function:
+template <typename MatrixType, typename VectorType>
+void subtract_boundary_columns(
+    const MatrixType &matrix,
+    const std::vector<types::global_dof_index> &boundary_dofs,
+    const std::vector<bool> &is_boundary_dof,
+    const std::vector<double> &boundary_values, VectorType &right_hand_side) {
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i)
+    if (boundary_values[i] != 0)
+      for (auto p = matrix.begin(boundary_dofs[i]);
+           p != matrix.end(boundary_dofs[i]); ++p)
+        if (!is_boundary_dof[p->column()])
+          right_hand_side(p->column()) -= p->value() * boundary_values[i];
+}
+
+template <typename MatrixType>
+void BoundaryMaskedMatrix<MatrixType>::initialize(
+    const MatrixType &matrix,
+    const std::vector<types::global_dof_index> &boundary_dofs) {
+  this->matrix = &matrix;
+  this->boundary_dofs = boundary_dofs;
+
+  is_boundary_dof.assign(matrix.m(), false);
+  boundary_diagonal.resize(boundary_dofs.size());
+  saved_boundary_values.resize(boundary_dofs.size());
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+    is_boundary_dof[boundary_dofs[i]] = true;
+    boundary_diagonal[i] = matrix.diag_element(boundary_dofs[i]);
+  }
+}
+
+// The source vector is only modified temporarily and restored before the
+// function returns, the same trick the matrix-free operators of the library
+// use to impose zero Dirichlet values on their input:
+template <typename MatrixType>
+template <typename VectorType>
+void BoundaryMaskedMatrix<MatrixType>::vmult(VectorType &dst,
+                                             const VectorType &src) const {
+  VectorType &src_masked = const_cast<VectorType &>(src);
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+    saved_boundary_values[i] = src(boundary_dofs[i]);
+    src_masked(boundary_dofs[i]) = 0;
+  }
+
+  matrix->vmult(dst, src);
+
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+    src_masked(boundary_dofs[i]) = saved_boundary_values[i];
+    dst(boundary_dofs[i]) = boundary_diagonal[i] * saved_boundary_values[i];
+  }
+}
+
+template <typename MatrixType>
+template <typename VectorType>
+void BoundaryMaskedMatrix<MatrixType>::apply_boundary_values(
+    const std::vector<double> &boundary_values, VectorType &solution,
+    VectorType &right_hand_side) const {
+  AssertDimension(boundary_values.size(), boundary_dofs.size());
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+    const types::global_dof_index row = boundary_dofs[i];
+    const double value = boundary_values[i];
+
+    solution(row) = value;
+    right_hand_side(row) = boundary_diagonal[i] * value;
+  }
+
+  subtract_boundary_columns(*matrix, boundary_dofs, is_boundary_dof,
+                            boundary_values, right_hand_side);
+}
+
+// @sect3{The <code>SellCSigmaMatrix</code> class}
+
+// In the compressed row storage of SparseMatrix, the inner loop of a
+// matrix-vector product runs over the entries of a single row. With
+// bilinear elements, that loop has only nine iterations in 2D, which is too
+// short for the compiler to make good use of SIMD instructions. The
+// SELL-$C$-$\sigma$ format (sliced ELLPACK) instead groups the rows into
+// chunks of $C$ rows, where $C$ is the number of doubles in a SIMD register,
+// and stores the $j$th entries of all rows of a chunk next to each other.
+// Shorter rows are padded with zeros to the length of the longest row of
+// their chunk. The product then works on $C$ rows at a time: it loads $C$
+// matrix entries at once and gathers the $C$ source vector entries they
+// multiply. To keep the padding small, the rows are sorted by their length
+// within windows of $\sigma$ consecutive rows before they are cut into
+// chunks. Sorting only within windows keeps rows close in memory if they
+// were close before, so the source vector entries are still read from the
+// cache. On our meshes, nearly all rows have the same length, except for
+// boundary rows and the rows of constrained degrees of freedom, and sorting
+// places these in chunks of their own.
+//
+// The class is built from an assembled SparseMatrix and keeps a pointer to
+// it. Assembly, the preconditioners, and the few operations that need
+// access to single rows, like BoundaryMaskedMatrix::apply_boundary_values,
+// keep using that matrix, so the sliced copy roughly doubles the memory
+// for each matrix it is made of. Only the matrix-vector products of the
+// time loop and of the CG iterations go through the sliced storage. The
+// class is derived from Subscriptor so that BoundaryMaskedMatrix can hold
+// it in a SmartPointer.
+template <typename number> class SellCSigmaMatrix : public Subscriptor {
+public:
+  using value_type = number;
+  using size_type = types::global_dof_index;
+
+  static constexpr unsigned int chunk_size = VectorizedArray<number>::size();
+
+  void reinit(const SparseMatrix<number> &matrix,
+              const unsigned int sorting_scope = 32 * chunk_size);
+
+  size_type m() const { return matrix->m(); }
+  size_type n() const { return matrix->n(); }
+
+  number diag_element(const size_type row) const {
+    return matrix->diag_element(row);
+  }
+
+  typename SparseMatrix<number>::const_iterator
+  begin(const size_type row) const {
+    return matrix->begin(row);
+  }
+
+  typename SparseMatrix<number>::const_iterator end(const size_type row) const {
+    return matrix->end(row);
+  }
+
+  void vmult(Vector<number> &dst, const Vector<number> &src) const;
+
+  std::size_t n_stored_entries() const { return values.size(); }
+  std::size_t memory_consumption() const;
+
+private:
+  SmartPointer<const SparseMatrix<number>> matrix;
+  std::vector<std::size_t> chunk_start;
+  std::vector<unsigned int> chunk_rows;
+  AlignedVector<number> values;
+  AlignedVector<unsigned int> columns;
+};
+
+// The entry $j$ of the row in slot $l$ of chunk $c$ is stored at position
+// <code>chunk_start[c] + j*C + l</code>; <code>chunk_rows</code> holds the
+// row in each slot, or an invalid index for the slots that pad the last
+// chunk. Padding entries have the value zero and point to column zero, so
+// that the product does not need to treat them separately:
+template <typename number>
+void SellCSigmaMatrix<number>::reinit(const SparseMatrix<number> &matrix,
+                                      const unsigned int sorting_scope) {
+  Assert(sorting_scope % chunk_size == 0,
+         ExcMessage("The sorting scope must be a multiple of the chunk size."));
+  AssertThrow(matrix.n() <= std::numeric_limits<unsigned int>::max(),
+              ExcMessage("Column indices are stored as unsigned int."));
+
+  this->matrix = &matrix;
+  const size_type n_rows = matrix.m();
+
+  std::vector<size_type> row_order(n_rows);
+  std::iota(row_order.begin(), row_order.end(), 0);
+  for (size_type begin = 0; begin < n_rows; begin += sorting_scope)
+    std::stable_sort(row_order.begin() + begin,
+                     row_order.begin() +
+                         std::min<size_type>(begin + sorting_scope, n_rows),
+                     [&](const size_type a, const size_type b) {
+                       return matrix.get_row_length(a) >
+                              matrix.get_row_length(b);
+                     });
+
+  const size_type n_chunks = (n_rows + chunk_size - 1) / chunk_size;
+  chunk_rows.assign(n_chunks * chunk_size, numbers::invalid_unsigned_int);
+  chunk_start.resize(n_chunks + 1);
+  chunk_start[0] = 0;
+  for (size_type chunk = 0; chunk < n_chunks; ++chunk) {
+    unsigned int width = 0;
+    for (unsigned int l = 0; l < chunk_size; ++l)
+      if (chunk * chunk_size + l < n_rows) {
+        const size_type row = row_order[chunk * chunk_size + l];
+        chunk_rows[chunk * chunk_size + l] = row;
+        width = std::max<unsigned int>(width, matrix.get_row_length(row));
+      }
+    chunk_start[chunk + 1] = chunk_start[chunk] + width * chunk_size;
+  }
+
+  values.clear();
+  values.resize(chunk_start.back(), number(0));
+  columns.clear();
+  columns.resize(chunk_start.back(), 0);
+  for (size_type chunk = 0; chunk < n_chunks; ++chunk)
+    for (unsigned int l = 0; l < chunk_size; ++l) {
+      const unsigned int row = chunk_rows[chunk * chunk_size + l];
+      if (row == numbers::invalid_unsigned_int)
+        continue;
+
+      std::size_t index = chunk_start[chunk] + l;
+      for (auto p = matrix.begin(row); p != matrix.end(row);
+           ++p, index += chunk_size) {
+        values[index] = p->value();
+        columns[index] = p->column();
+      }
+    }
+}
+
+// The product works on one chunk at a time, and the chunks are split into
+// ranges that are worked on in parallel. For every $j$, it loads the $j$th
+// entries of the $C$ rows of a chunk into one SIMD register, gathers the
+// corresponding source vector entries into another one, and accumulates
+// their product. The $C$ sums are then written to the rows of the chunk:
+template <typename number>
+void SellCSigmaMatrix<number>::vmult(Vector<number> &dst,
+                                     const Vector<number> &src) const {
+  AssertDimension(dst.size(), m());
+  AssertDimension(src.size(), n());
+
+  parallel::apply_to_subranges(
+      std::size_t(0), chunk_start.size() - 1,
+      [&](const std::size_t begin, const std::size_t end) {
+        for (std::size_t chunk = begin; chunk < end; ++chunk) {
+          VectorizedArray<number> sum = make_vectorized_array(number(0));
+          for (std::size_t index = chunk_start[chunk];
+               index < chunk_start[chunk + 1]; index += chunk_size) {
+            VectorizedArray<number> matrix_values, source_values;
+            matrix_values.load(values.data() + index);
+            source_values.gather(src.begin(), columns.data() + index);
+            sum += matrix_values * source_values;
+          }
+
+          for (unsigned int l = 0; l < chunk_size; ++l) {
+            const unsigned int row = chunk_rows[chunk * chunk_size + l];
+            if (row != numbers::invalid_unsigned_int)
+              dst(row) = sum[l];
+          }
+        }
+      },
+      32);
+}
+
+template <typename number>
+std::size_t SellCSigmaMatrix<number>::memory_consumption() const {
+  return MemoryConsumption::memory_consumption(chunk_start) +
+         MemoryConsumption::memory_consumption(chunk_rows) +
+         values.memory_consumption() + columns.memory_consumption();
+}
+
+// @sect3{The <code>SymmetricSparsityPattern</code> and <code>SymmetricSparseMatrix</code> classes}
+
+// The mass and Laplace matrices are symmetric, so half of the entries a
+// SparseMatrix stores for them are redundant. The following two classes
+// keep only the diagonal and, in compressed row storage, the entries to the
+// right of the diagonal; the product $y=Ax$ is then computed as $y_i =
+// a_{ii}x_i + \sum_{j>i} a_{ij}x_j + \sum_{j<i} a_{ji}x_j$. The second sum
+// is formed by scattering: when row $i$ is processed, $a_{ij}x_i$ is added
+// to $y_j$ for all its entries $j>i$. As for the full matrices, the column
+// indices of the upper triangle are stored once, in a
+// SymmetricSparsityPattern, and shared by the mass and the Laplace matrix.
+//
+// Scattering makes it harder to work on several rows in parallel, since
+// two threads may add to the same $y_j$. We therefore cut the rows into
+// ranges that are at least as long as the largest distance of an entry
+// from the diagonal. Then a row of range $r$ only ever scatters into rows
+// of ranges $r$ and $r+1$, so all even-numbered ranges can be worked on
+// concurrently, followed by all odd-numbered ones. The smaller the
+// bandwidth of the matrix, the more ranges there are. Without a
+// bandwidth-reducing renumbering of the degrees of freedom, the bandwidth
+// of an adaptively refined mesh is close to the number of unknowns, there
+// is only a single range, and the product runs serially; symmetric storage
+// therefore requires one of the Cuthill-McKee orderings (see the "DoF
+// ordering" parameter). The length of the ranges is a property of the
+// pattern and is determined along with it, aiming at a few ranges per
+// thread:
+struct SymmetricSparsityPattern : public Subscriptor {
+  using size_type = types::global_dof_index;
+
+  void reinit(const SparsityPattern &sparsity_pattern);
+
+  size_type n_rows() const { return row_start.size() - 1; }
+  std::size_t memory_consumption() const;
+
+  std::vector<std::size_t> row_start;
+  std::vector<unsigned int> columns;
+  size_type rows_per_range;
+};
+
+void SymmetricSparsityPattern::reinit(const SparsityPattern &sparsity_pattern) {
+  AssertThrow(sparsity_pattern.n_cols() <=
+                  std::numeric_limits<unsigned int>::max(),
+              ExcMessage("Column indices are stored as unsigned int."));
+
+  const size_type n_rows = sparsity_pattern.n_rows();
+  row_start.assign(n_rows + 1, 0);
+  size_type bandwidth = 0;
+  for (size_type row = 0; row < n_rows; ++row)
+    for (auto p = sparsity_pattern.begin(row); p != sparsity_pattern.end(row);
+         ++p)
+      if (p->column() > row) {
+        ++row_start[row + 1];
+        bandwidth = std::max<size_type>(bandwidth, p->column() - row);
+      }
+  std::partial_sum(row_start.begin(), row_start.end(), row_start.begin());
+
+  columns.resize(row_start.back());
+  for (size_type row = 0; row < n_rows; ++row) {
+    std::size_t index = row_start[row];
+    for (auto p = sparsity_pattern.begin(row); p != sparsity_pattern.end(row);
+         ++p)
+      if (p->column() > row)
+        columns[index++] = p->column();
+  }
+
+  const size_type n_target_ranges = 8 * MultithreadInfo::n_threads();
+  rows_per_range = std::max<size_type>(
+      {bandwidth, (n_rows + n_target_ranges - 1) / n_target_ranges, 1});
+}
+
+std::size_t SymmetricSparsityPattern::memory_consumption() const {
+  return MemoryConsumption::memory_consumption(row_start) +
+         MemoryConsumption::memory_consumption(columns);
+}
+
+// Besides the products, the matrix class offers what BoundaryMaskedMatrix
+// and the MatrixFreePreconditioner class need: the diagonal, both entry by
+// entry and as a vector. Like the other matrix classes, it is derived from
+// Subscriptor, since PreconditionChebyshev keeps a SmartPointer to it.
+template <typename number> class SymmetricSparseMatrix : public Subscriptor {
+public:
+  using value_type = number;
+  using size_type = types::global_dof_index;
+
+  void reinit(const SymmetricSparsityPattern &symmetric_sparsity_pattern,
+              const SparseMatrix<number> &matrix);
+
+  size_type m() const { return diagonal.size(); }
+  size_type n() const { return diagonal.size(); }
+
+  number diag_element(const size_type row) const { return diagonal(row); }
+  const Vector<number> &get_diagonal() const { return diagonal; }
+
+  void vmult(Vector<number> &dst, const Vector<number> &src) const;
+  number matrix_norm_square(const Vector<number> &v) const;
+
+  std::size_t memory_consumption() const;
+
+private:
+  SmartPointer<const SymmetricSparsityPattern> sparsity_pattern;
+  Vector<number> diagonal;
+  std::vector<number> values;
+};
+
+// The entries left of the diagonal of the given matrix are simply ignored;
+// it is the caller's responsibility to hand in a symmetric matrix built on
+// the SparsityPattern the symmetric one was created from, so that the
+// entries right of the diagonal come in the same order:
+template <typename number>
+void SymmetricSparseMatrix<number>::reinit(
+    const SymmetricSparsityPattern &symmetric_sparsity_pattern,
+    const SparseMatrix<number> &matrix) {
+  AssertDimension(symmetric_sparsity_pattern.n_rows(), matrix.m());
+
+  sparsity_pattern = &symmetric_sparsity_pattern;
+  const size_type n_rows = matrix.m();
+  diagonal.reinit(n_rows);
+  values.resize(sparsity_pattern->columns.size());
+  for (size_type row = 0; row < n_rows; ++row) {
+    std::size_t index = sparsity_pattern->row_start[row];
+    for (auto p = matrix.begin(row); p != matrix.end(row); ++p)
+      if (p->column() == row)
+        diagonal[row] = p->value();
+      else if (p->column() > row) {
+        Assert(sparsity_pattern->columns[index] == p->column(),
+               ExcInternalError());
+        values[index++] = p->value();
+      }
+  }
+}
+
+template <typename number>
+void SymmetricSparseMatrix<number>::vmult(Vector<number> &dst,
+                                          const Vector<number> &src) const {
+  AssertDimension(dst.size(), m());
+  AssertDimension(src.size(), n());
+
+  const std::vector<std::size_t> &row_start = sparsity_pattern->row_start;
+  const std::vector<unsigned int> &columns = sparsity_pattern->columns;
+  const size_type rows_per_range = sparsity_pattern->rows_per_range;
+
+  dst = 0;
+  const size_type n_rows = m();
+  const size_type n_ranges = (n_rows + rows_per_range - 1) / rows_per_range;
+  for (unsigned int phase = 0; phase < 2; ++phase)
+    parallel::apply_to_subranges(
+        size_type(0), (n_ranges + 1 - phase) / 2,
+        [&](const size_type begin, const size_type end) {
+          for (size_type k = begin; k < end; ++k) {
+            const size_type first_row = (2 * k + phase) * rows_per_range;
+            const size_type last_row =
+                std::min(first_row + rows_per_range, n_rows);
+            for (size_type row = first_row; row < last_row; ++row) {
+              const number src_row = src(row);
+              number sum = diagonal[row] * src_row;
+              for (std::size_t index = row_start[row];
+                   index < row_start[row + 1]; ++index) {
+                sum += values[index] * src(columns[index]);
+                dst(columns[index]) += values[index] * src_row;
+              }
+              dst(row) += sum;
+            }
+          }
+        },
+        1);
+}
+
+// The product $v^TAv = \sum_i a_{ii}v_i^2 + 2\sum_i\sum_{j>i} a_{ij}v_iv_j$
+// needs no scattering at all, and its rows can be summed up in parallel:
+template <typename number>
+number SymmetricSparseMatrix<number>::matrix_norm_square(
+    const Vector<number> &v) const {
+  AssertDimension(v.size(), m());
+
+  const std::vector<std::size_t> &row_start = sparsity_pattern->row_start;
+  const std::vector<unsigned int> &columns = sparsity_pattern->columns;
+
+  return parallel::accumulate_from_subranges<number>(
+      [&](const size_type begin, const size_type end) {
+        number sum = 0;
+        for (size_type row = begin; row < end; ++row) {
+          number upper = 0;
+          for (std::size_t index = row_start[row]; index < row_start[row + 1];
+               ++index)
+            upper += values[index] * v(columns[index]);
+          sum += v(row) * (diagonal[row] * v(row) + 2 * upper);
+        }
+        return sum;
+      },
+      0, m(), 256);
+}
+
+// The memory consumption only counts the values; the indices are counted
+// with the SymmetricSparsityPattern, which is shared:
+template <typename number>
+std::size_t SymmetricSparseMatrix<number>::memory_consumption() const {
+  return diagonal.memory_consumption() +
+         MemoryConsumption::memory_consumption(values);
+}
+
+// The entries of the boundary columns are spread over the rows above the
+// boundary rows, so they can not be read from the boundary rows as for a
+// SparseMatrix. Instead, we multiply the matrix with a lifting of the
+// boundary values, i.e., a vector that only holds these values, and
+// subtract the result in all other rows. This costs one product, which we
+// save if all boundary values are zero:
+template <typename number>
+void subtract_boundary_columns(
+    const SymmetricSparseMatrix<number> &matrix,
+    const std::vector<types::global_dof_index> &boundary_dofs,
+    const std::vector<bool> &is_boundary_dof,
+    const std::vector<double> &boundary_values,
+    Vector<number> &right_hand_side) {
+  if (std::all_of(boundary_values.begin(), boundary_values.end(),
+                  [](const double value) { return value == 0; }))
+    return;
+
+  Vector<number> lifting(matrix.m()), lifting_product(matrix.m());
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i)
+    lifting(boundary_dofs[i]) = boundary_values[i];
+  matrix.vmult(lifting_product, lifting);
+
+  for (types::global_dof_index row = 0; row < matrix.m(); ++row)
+    if (!is_boundary_dof[row])
+      right_hand_side(row) -= lifting_product(row);
+}
+
+// @sect3{The <code>DeltaCompressedColumnIndices</code> class}
+
+// Besides the matrix entries, a sparse matrix-vector product has to read
+// one column index per entry, four bytes in a SparsityPattern, which is a
+// large fraction of the memory traffic. Within a row, however, the column
+// indices are sorted (apart from the diagonal entry, which comes first),
+// and after a bandwidth-reducing renumbering of the degrees of freedom they
+// are also close to the row index. The following class therefore stores
+// every column index as a 16-bit difference to the previous one in its
+// row, where the first one is taken relative to the row index itself.
+// Differences that do not fit into 16 bits are marked by an escape value
+// and followed by the full 32-bit column index in two 16-bit words. The
+// indices are decoded on the fly, one row at a time, by the
+// <code>for_each_entry</code> function, which calls a function with the
+// position of every entry in the SparsityPattern (where the matrix values
+// are stored) and its column.
+class DeltaCompressedColumnIndices {
+public:
+  using size_type = types::global_dof_index;
+
+  void reinit(const SparsityPattern &sparsity_pattern);
+
+  template <typename Function>
+  void for_each_entry(const size_type row, const Function &function) const;
+
+  std::size_t memory_consumption() const;
+  std::size_t n_escapes() const { return escapes; }
+
+private:
+  static constexpr std::int16_t escape =
+      std::numeric_limits<std::int16_t>::min();
+
+  std::vector<unsigned int> entry_start;
+  std::vector<unsigned int> code_start;
+  std::vector<std::int16_t> codes;
+  std::size_t escapes;
+};
+
+void DeltaCompressedColumnIndices::reinit(
+    const SparsityPattern &sparsity_pattern) {
+  AssertThrow(sparsity_pattern.n_nonzero_elements() <
+                  std::numeric_limits<unsigned int>::max() / 3,
+              ExcMessage("Entry positions are stored as unsigned int."));
+
+  const size_type n_rows = sparsity_pattern.n_rows();
+  entry_start.resize(n_rows + 1);
+  code_start.resize(n_rows + 1);
+  codes.clear();
+  escapes = 0;
+
+  entry_start[0] = 0;
+  for (size_type row = 0; row < n_rows; ++row) {
+    entry_start[row + 1] =
+        entry_start[row] + sparsity_pattern.row_length(row);
+    code_start[row] = codes.size();
+
+    long long previous_column = row;
+    for (auto p = sparsity_pattern.begin(row); p != sparsity_pattern.end(row);
+         ++p) {
+      const long long column = p->column();
+      const long long difference = column - previous_column;
+      if (difference > std::numeric_limits<std::int16_t>::min() &&
+          difference <= std::numeric_limits<std::int16_t>::max())
+        codes.push_back(static_cast<std::int16_t>(difference));
+      else {
+        codes.push_back(escape);
+        codes.push_back(static_cast<std::int16_t>(column & 0xffff));
+        codes.push_back(static_cast<std::int16_t>(column >> 16));
+        ++escapes;
+      }
+      previous_column = column;
+    }
+  }
+  code_start[n_rows] = codes.size();
+}
+
+template <typename Function>
+void DeltaCompressedColumnIndices::for_each_entry(
+    const size_type row, const Function &function) const {
+  const std::int16_t *code = codes.data() + code_start[row];
+  unsigned int column = row;
+  for (unsigned int index = entry_start[row]; index < entry_start[row + 1];
+       ++index) {
+    if (*code != escape)
+      column += *code++;
+    else {
+      column = static_cast<std::uint16_t>(code[1]) |
+               (static_cast<unsigned int>(static_cast<std::uint16_t>(code[2]))
+                << 16);
+      code += 3;
+    }
+    function(index, column);
+  }
+}
+
+std::size_t DeltaCompressedColumnIndices::memory_consumption() const {
+  return MemoryConsumption::memory_consumption(entry_start) +
+         MemoryConsumption::memory_consumption(code_start) +
+         MemoryConsumption::memory_consumption(codes);
+}
+
+// @sect3{A fused kernel for the right hand side products}
+
+// The right hand sides of the two equations of the $\theta$-scheme need
+// the products $MU^{n-1}$, $MV^{n-1}$ and $AU^{n-1}$. Computing them with
+// separate calls to SparseMatrix::vmult means reading the column indices of
+// the common sparsity pattern and the two source vectors several times,
+// even though these products are all limited by memory bandwidth. The
+// following function computes all three in a single sweep over the rows,
+// reading every column index and every source vector entry only once. Like
+// SparseMatrix::vmult, it splits the rows into chunks that are worked on in
+// parallel. If a DeltaCompressedColumnIndices object built from the common
+// sparsity pattern is given, the column indices are read from it instead,
+// and the matrix values by their position in the pattern:
+template <typename number>
+void fused_wave_vmult(
+    const SparseMatrix<number> &mass_matrix,
+    const SparseMatrix<number> &laplace_matrix, const Vector<double> &u,
+    const Vector<double> &v, Vector<double> &mass_times_u,
+    Vector<double> &mass_times_v, Vector<double> &laplace_times_u,
+    const DeltaCompressedColumnIndices *compressed_column_indices = nullptr) {
+  Assert(&mass_matrix.get_sparsity_pattern() ==
+             &laplace_matrix.get_sparsity_pattern(),
+         ExcMessage("The mass and Laplace matrices need to share their "
+                    "sparsity pattern."));
+
+  parallel::apply_to_subranges(
+      types::global_dof_index(0), mass_matrix.m(),
+      [&](const types::global_dof_index begin,
+          const types::global_dof_index end) {
+        for (types::global_dof_index row = begin; row < end; ++row) {
+          double mu = 0, mv = 0, au = 0;
+          if (compressed_column_indices != nullptr)
+            compressed_column_indices->for_each_entry(
+                row, [&](const std::size_t index,
+                         const types::global_dof_index column) {
+                  const double m_ij = mass_matrix.global_entry(index);
+                  const double u_j = u(column);
+                  mu += m_ij * u_j;
+                  mv += m_ij * v(column);
+                  au += laplace_matrix.global_entry(index) * u_j;
+                });
+          else {
+            auto a = laplace_matrix.begin(row);
+            for (auto m = mass_matrix.begin(row); m != mass_matrix.end(row);
+                 ++m, ++a) {
+              const types::global_dof_index column = m->column();
+              const double u_j = u(column);
+              mu += m->value() * u_j;
+              mv += m->value() * v(column);
+              au += a->value() * u_j;
+            }
+          }
+          mass_times_u(row) = mu;
+          mass_times_v(row) = mv;
+          laplace_times_u(row) = au;
+        }
+      },
+      256);
+}
+
+// @sect3{The <code>InterleavedWaveMatrix</code> and <code>WaveMatrixCombination</code> classes}
+
+// Every matrix the $\theta$-scheme needs is a linear combination
+// $\alpha M + \beta A$ of the mass and Laplace matrices on one sparsity
+// pattern, and storing $M+k^2\theta^2A$ as a third matrix costs as much
+// memory as $M$ and $A$ themselves. The following class instead stores the
+// two values $m_{ij}$ and $a_{ij}$ of every nonzero entry next to each
+// other, in the order of the shared SparsityPattern, and forms any
+// combination of them on the fly. A matrix-vector product with $\alpha M +
+// \beta A$ then reads two values per entry, but only one column index, and
+// it is no more expensive in terms of memory traffic than a product with
+// $M+k^2\theta^2A$ stored as a matrix of its own. Since nothing depends on
+// $\theta$ or $k$ until a product is formed, the factors can be changed at
+// no cost. Like fused_wave_vmult(), the class also offers the three
+// products the right hand side of the $\theta$-scheme needs in one sweep.
+// Optionally, the products read the column indices from a
+// DeltaCompressedColumnIndices object instead of the SparsityPattern.
+template <typename number> class InterleavedWaveMatrix : public Subscriptor {
+public:
+  using size_type = types::global_dof_index;
+
+  void reinit(const SparseMatrix<number> &mass_matrix,
+              const SparseMatrix<number> &laplace_matrix,
+              const bool compress_column_indices = false);
+
+  size_type m() const { return sparsity_pattern->n_rows(); }
+  size_type n() const { return sparsity_pattern->n_cols(); }
+
+  const SparsityPattern &get_sparsity_pattern() const {
+    return *sparsity_pattern;
+  }
+
+  number mass_value(const std::size_t index) const {
+    return values[2 * index];
+  }
+  number laplace_value(const std::size_t index) const {
+    return values[2 * index + 1];
+  }
+
+  void vmult(Vector<number> &dst, const Vector<number> &src,
+             const number alpha, const number beta) const;
+
+  void vmult_mass_and_laplace(const Vector<number> &u,
+                              const Vector<number> &v,
+                              Vector<number> &mass_times_u,
+                              Vector<number> &mass_times_v,
+                              Vector<number> &laplace_times_u) const;
+
+  number matrix_norm_square(const Vector<number> &v, const number alpha,
+                            const number beta) const;
+
+  const DeltaCompressedColumnIndices &get_compressed_column_indices() const {
+    return compressed_column_indices;
+  }
+
+private:
+  template <typename Function>
+  void for_each_entry(const size_type row, const Function &function) const;
+
+  SmartPointer<const SparsityPattern> sparsity_pattern;
+  bool use_compressed_column_indices;
+  DeltaCompressedColumnIndices compressed_column_indices;
+  AlignedVector<number> values;
+};
+
+template <typename number>
+void InterleavedWaveMatrix<number>::reinit(
+    const SparseMatrix<number> &mass_matrix,
+    const SparseMatrix<number> &laplace_matrix,
+    const bool compress_column_indices) {
+  Assert(&mass_matrix.get_sparsity_pattern() ==
+             &laplace_matrix.get_sparsity_pattern(),
+         ExcMessage("The mass and Laplace matrices need to share their "
+                    "sparsity pattern."));
+
+  sparsity_pattern = &mass_matrix.get_sparsity_pattern();
+  values.resize(2 * sparsity_pattern->n_nonzero_elements());
+  for (size_type row = 0; row < m(); ++row) {
+    auto a = laplace_matrix.begin(row);
+    for (auto p = mass_matrix.begin(row); p != mass_matrix.end(row);
+         ++p, ++a) {
+      const std::size_t index = p->global_index();
+      values[2 * index] = p->value();
+      values[2 * index + 1] = a->value();
+    }
+  }
+
+  use_compressed_column_indices = compress_column_indices;
+  if (use_compressed_column_indices)
+    compressed_column_indices.reinit(*sparsity_pattern);
+}
+
+// All products loop over the entries of a row through the following
+// function, which hands the position of each entry and its column to the
+// given function, decoding the column indices if they are compressed:
+template <typename number>
+template <typename Function>
+void InterleavedWaveMatrix<number>::for_each_entry(
+    const size_type row, const Function &function) const {
+  if (use_compressed_column_indices)
+    compressed_column_indices.for_each_entry(row, function);
+  else
+    for (auto p = sparsity_pattern->begin(row); p != sparsity_pattern->end(row);
+         ++p)
+      function(p->global_index(), p->column());
+}
+
+template <typename number>
+void InterleavedWaveMatrix<number>::vmult(Vector<number> &dst,
+                                          const Vector<number> &src,
+                                          const number alpha,
+                                          const number beta) const {
+  parallel::apply_to_subranges(
+      size_type(0), m(),
+      [&](const size_type begin, const size_type end) {
+        for (size_type row = begin; row < end; ++row) {
+          number sum = 0;
+          for_each_entry(row, [&](const std::size_t index,
+                                  const size_type column) {
+            sum += (alpha * values[2 * index] + beta * values[2 * index + 1]) *
+                   src(column);
+          });
+          dst(row) = sum;
+        }
+      },
+      256);
+}
+
+template <typename number>
+void InterleavedWaveMatrix<number>::vmult_mass_and_laplace(
+    const Vector<number> &u, const Vector<number> &v,
+    Vector<number> &mass_times_u, Vector<number> &mass_times_v,
+    Vector<number> &laplace_times_u) const {
+  parallel::apply_to_subranges(
+      size_type(0), m(),
+      [&](const size_type begin, const size_type end) {
+        for (size_type row = begin; row < end; ++row) {
+          number mu = 0, mv = 0, au = 0;
+          for_each_entry(row, [&](const std::size_t index,
+                                  const size_type column) {
+            const number u_j = u(column);
+            mu += values[2 * index] * u_j;
+            mv += values[2 * index] * v(column);
+            au += values[2 * index + 1] * u_j;
+          });
+          mass_times_u(row) = mu;
+          mass_times_v(row) = mv;
+          laplace_times_u(row) = au;
+        }
+      },
+      256);
+}
+
+template <typename number>
+number InterleavedWaveMatrix<number>::matrix_norm_square(
+    const Vector<number> &v, const number alpha, const number beta) const {
+  return parallel::accumulate_from_subranges<number>(
+      [&](const size_type begin, const size_type end) {
+        number sum = 0;
+        for (size_type row = begin; row < end; ++row) {
+          number row_sum = 0;
+          for_each_entry(row, [&](const std::size_t index,
+                                  const size_type column) {
+            row_sum +=
+                (alpha * values[2 * index] + beta * values[2 * index + 1]) *
+                v(column);
+          });
+          sum += v(row) * row_sum;
+        }
+        return sum;
+      },
+      0, m(), 256);
+}
+
+// The linear solvers and BoundaryMaskedMatrix need an object that looks
+// like a single matrix. The following class represents one fixed
+// combination $\alpha M+\beta A$ of an InterleavedWaveMatrix, with the
+// functions BoundaryMaskedMatrix uses: the diagonal elements, the
+// product, and iterators over the entries of a row whose values are
+// combined on the fly. It also provides the diagonal as a vector, so that
+// it can be preconditioned with the MatrixFreePreconditioner class
+// declared below. As for the MatrixFreeWaveOperator class below, a lumped
+// mass matrix $M_L$ can be given, in which case the combination is $\alpha
+// M_L+\beta A$:
+template <typename number> class WaveMatrixCombination : public Subscriptor {
+public:
+  using value_type = number;
+  using size_type = types::global_dof_index;
+
+  class const_iterator {
+  public:
+    const_iterator(const WaveMatrixCombination *combination,
+                   const SparsityPattern::iterator &entry)
+        : combination(combination), entry(entry) {}
+
+    const const_iterator *operator->() const { return this; }
+    size_type column() const { return entry->column(); }
+    number value() const {
+      const std::size_t index = entry->global_index();
+      number value =
+          combination->beta * combination->matrix->laplace_value(index);
+      if (combination->lumped_mass_matrix == nullptr)
+        value += combination->alpha * combination->matrix->mass_value(index);
+      else if (entry->column() == entry->row())
+        value += combination->alpha *
+                 (*combination->lumped_mass_matrix)(entry->row());
+      return value;
+    }
+
+    const_iterator &operator++() {
+      ++entry;
+      return *this;
+    }
+    bool operator!=(const const_iterator &other) const {
+      return entry != other.entry;
+    }
+
+  private:
+    const WaveMatrixCombination *combination;
+    SparsityPattern::iterator entry;
+  };
+
+  void initialize(const InterleavedWaveMatrix<number> &matrix,
+                  const number alpha, const number beta,
+                  const Vector<number> *lumped_mass_matrix = nullptr);
+
+  size_type m() const { return matrix->m(); }
+  size_type n() const { return matrix->n(); }
+
+  number diag_element(const size_type row) const { return diagonal(row); }
+  const Vector<number> &get_diagonal() const { return diagonal; }
+
+  const_iterator begin(const size_type row) const {
+    return const_iterator(this, matrix->get_sparsity_pattern().begin(row));
+  }
+  const_iterator end(const size_type row) const {
+    return const_iterator(this, matrix->get_sparsity_pattern().end(row));
+  }
+
+  void vmult(Vector<number> &dst, const Vector<number> &src) const;
+
+private:
+  SmartPointer<const InterleavedWaveMatrix<number>> matrix;
+  number alpha, beta;
+  SmartPointer<const Vector<number>> lumped_mass_matrix;
+  Vector<number> diagonal;
+};
+
+// The diagonal entry is stored first in every row of a square
+// SparsityPattern:
+template <typename number>
+void WaveMatrixCombination<number>::initialize(
+    const InterleavedWaveMatrix<number> &matrix, const number alpha,
+    const number beta, const Vector<number> *lumped_mass_matrix) {
+  this->matrix = &matrix;
+  this->alpha = alpha;
+  this->beta = beta;
+  this->lumped_mass_matrix = lumped_mass_matrix;
+
+  diagonal.reinit(matrix.m());
+  for (size_type row = 0; row < matrix.m(); ++row)
+    diagonal(row) = begin(row)->value();
+}
+
+template <typename number>
+void WaveMatrixCombination<number>::vmult(Vector<number> &dst,
+                                          const Vector<number> &src) const {
+  if (lumped_mass_matrix == nullptr)
+    matrix->vmult(dst, src, alpha, beta);
+  else {
+    matrix->vmult(dst, src, 0, beta);
+    for (size_type row = 0; row < m(); ++row)
+      dst(row) += alpha * (*lumped_mass_matrix)(row) * src(row);
+  }
+}
+
+// @sect3{A matrix-free operator for the mass and Laplace matrices}
+
+// All matrices of this program are of the form $\alpha M + \beta A$ on one
+// sparsity pattern, and applying them dominates the run time. As in
+// step-37, we can instead evaluate the action of such an operator cell by
+// cell from the shape functions at the quadrature points, using the sum
+// factorization kernels of the FEEvaluation class. No matrix is stored at
+// all, and since the cost per degree of freedom grows only slowly with the
+// polynomial degree, higher degree elements become affordable. Hanging node
+// constraints are taken care of by the MatrixFree object: the values of
+// constrained degrees of freedom are computed from their masters when
+// reading the source vector, and contributions to them are distributed to
+// the masters when writing the result.
+//
+// The class offers two kinds of products. The <code>apply</code> function
+// computes $(\alpha M + \beta A)x$ with the constrained rows set to zero;
+// this is what we need for the right hand sides of the time stepping
+// schemes. If a lumped mass matrix $M_L$ is given, the operator is $\alpha
+// M_L + \beta A$ instead, and the diagonal term is simply added after the
+// loop over the cells. The <code>vmult</code> function represents the
+// operator with boundary values applied in the same way as
+// BoundaryMaskedMatrix does for sparse matrices, with constrained rows
+// replaced by the identity so that CG sees a symmetric positive definite
+// operator; it is the one to be handed to the linear solvers, together
+// with the <code>apply_boundary_values</code> function that sets up the
+// right hand side. The diagonal of this operator, as needed for the
+// boundary rows and for the Jacobi and Chebyshev preconditioners, is
+// computed in the same way as in step-37, by applying the cell operator to
+// unit vectors. On cells with hanging nodes this is only an approximation
+// of the true diagonal of the constrained operator, which is all we need.
+// Like the matrix classes of the library, the operator is derived from
+// Subscriptor, since PreconditionChebyshev keeps a SmartPointer to it.
+template <int dim> class MatrixFreeWaveOperator : public Subscriptor {
+public:
+  using value_type = double;
+
+  void initialize(std::shared_ptr<const MatrixFree<dim, double>> matrix_free,
+                  const std::vector<types::global_dof_index> &boundary_dofs,
+                  const double mass_factor, const double laplace_factor,
+                  const Vector<double> *lumped_mass_matrix = nullptr);
+
+  types::global_dof_index m() const;
+  types::global_dof_index n() const;
+
+  void apply(Vector<double> &dst, const Vector<double> &src) const;
+  void vmult(Vector<double> &dst, const Vector<double> &src) const;
+
+  void apply_boundary_values(const std::vector<double> &boundary_values,
+                             Vector<double> &solution,
+                             Vector<double> &right_hand_side) const;
+
+  const Vector<double> &get_diagonal() const;
+
+private:
+  EvaluationFlags::EvaluationFlags evaluation_flags() const;
+  void do_quadrature(FEEvaluation<dim, -1> &phi) const;
+  void
+  local_apply(const MatrixFree<dim, double> &matrix_free, Vector<double> &dst,
+              const Vector<double> &src,
+              const std::pair<unsigned int, unsigned int> &cell_range) const;
+  void compute_diagonal();
+
+  std::shared_ptr<const MatrixFree<dim, double>> matrix_free;
+  double mass_factor;
+  double laplace_factor;
+  double lumped_mass_factor;
+  SmartPointer<const Vector<double>> lumped_mass_matrix;
+
+  std::vector<types::global_dof_index> boundary_dofs;
+  Vector<double> diagonal;
+  mutable std::vector<double> saved_boundary_values;
+  mutable Vector<double> boundary_lifting, boundary_lifting_product;
+};
+
+template <int dim>
+void MatrixFreeWaveOperator<dim>::initialize(
+    std::shared_ptr<const MatrixFree<dim, double>> matrix_free,
+    const std::vector<types::global_dof_index> &boundary_dofs,
+    const double mass_factor, const double laplace_factor,
+    const Vector<double> *lumped_mass_matrix) {
+  this->matrix_free = matrix_free;
+  this->boundary_dofs = boundary_dofs;
+  this->mass_factor = (lumped_mass_matrix == nullptr ? mass_factor : 0.);
+  this->laplace_factor = laplace_factor;
+  this->lumped_mass_factor =
+      (lumped_mass_matrix == nullptr ? 0. : mass_factor);
+  this->lumped_mass_matrix = lumped_mass_matrix;
+
+  saved_boundary_values.resize(boundary_dofs.size());
+  boundary_lifting.reinit(m());
+  boundary_lifting_product.reinit(m());
+  compute_diagonal();
+}
+
+template <int dim>
+types::global_dof_index MatrixFreeWaveOperator<dim>::m() const {
+  return matrix_free->get_dof_handler().n_dofs();
+}
+
+template <int dim>
+types::global_dof_index MatrixFreeWaveOperator<dim>::n() const {
+  return m();
+}
+
+template <int dim>
+const Vector<double> &MatrixFreeWaveOperator<dim>::get_diagonal() const {
+  return diagonal;
+}
+
+// The mass matrix only needs the values and the Laplace matrix only the
+// gradients of the shape functions, so operators that consist of only one
+// of the two skip the other half of the work:
+template <int dim>
+EvaluationFlags::EvaluationFlags
+MatrixFreeWaveOperator<dim>::evaluation_flags() const {
+  EvaluationFlags::EvaluationFlags flags = EvaluationFlags::nothing;
+  if (mass_factor != 0)
+    flags |= EvaluationFlags::values;
+  if (laplace_factor != 0)
+    flags |= EvaluationFlags::gradients;
+  return flags;
+}
+
+template <int dim>
+void MatrixFreeWaveOperator<dim>::do_quadrature(
+    FEEvaluation<dim, -1> &phi) const {
+  const EvaluationFlags::EvaluationFlags flags = evaluation_flags();
+  phi.evaluate(flags);
+  for (const unsigned int q : phi.quadrature_point_indices()) {
+    if (mass_factor != 0)
+      phi.submit_value(mass_factor * phi.get_value(q), q);
+    if (laplace_factor != 0)
+      phi.submit_gradient(laplace_factor * phi.get_gradient(q), q);
+  }
+  phi.integrate(flags);
+}
+
+template <int dim>
+void MatrixFreeWaveOperator<dim>::local_apply(
+    const MatrixFree<dim, double> &matrix_free, Vector<double> &dst,
+    const Vector<double> &src,
+    const std::pair<unsigned int, unsigned int> &cell_range) const {
+  FEEvaluation<dim, -1> phi(matrix_free);
+  for (unsigned int cell = cell_range.first; cell < cell_range.second;
+       ++cell) {
+    phi.reinit(cell);
+    phi.read_dof_values(src);
+    do_quadrature(phi);
+    phi.distribute_local_to_global(dst);
+  }
+}
+
+template <int dim>
+void MatrixFreeWaveOperator<dim>::apply(Vector<double> &dst,
+                                        const Vector<double> &src) const {
+  matrix_free->cell_loop(&MatrixFreeWaveOperator::local_apply, this, dst, src,
+                         true);
+
+  if (lumped_mass_factor != 0) {
+    for (types::global_dof_index i = 0; i < m(); ++i)
+      dst(i) += lumped_mass_factor * (*lumped_mass_matrix)(i) * src(i);
+    for (const auto dof : matrix_free->get_constrained_dofs())
+      dst(dof) = 0;
+  }
+}
+
+template <int dim>
+void MatrixFreeWaveOperator<dim>::vmult(Vector<double> &dst,
+                                        const Vector<double> &src) const {
+  Vector<double> &src_masked = const_cast<Vector<double> &>(src);
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+    saved_boundary_values[i] = src(boundary_dofs[i]);
+    src_masked(boundary_dofs[i]) = 0;
+  }
+
+  apply(dst, src);
+
+  for (const auto dof : matrix_free->get_constrained_dofs())
+    dst(dof) = src(dof);
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+    src_masked(boundary_dofs[i]) = saved_boundary_values[i];
+    dst(boundary_dofs[i]) =
+        diagonal(boundary_dofs[i]) * saved_boundary_values[i];
+  }
+}
+
+// Without a matrix to read the boundary columns from, we move the
+// contributions of the boundary values to the right hand side by applying
+// the operator to a vector that contains only the boundary values, i.e.,
+// to a lifting of the boundary values. This costs one operator
+// application, which we save if all boundary values are zero:
+template <int dim>
+void MatrixFreeWaveOperator<dim>::apply_boundary_values(
+    const std::vector<double> &boundary_values, Vector<double> &solution,
+    Vector<double> &right_hand_side) const {
+  AssertDimension(boundary_values.size(), boundary_dofs.size());
+
+  bool all_zero = true;
+  boundary_lifting = 0;
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+    boundary_lifting(boundary_dofs[i]) = boundary_values[i];
+    if (boundary_values[i] != 0)
+      all_zero = false;
+  }
+
+  if (!all_zero) {
+    apply(boundary_lifting_product, boundary_lifting);
+    right_hand_side -= boundary_lifting_product;
+  }
+
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+    solution(boundary_dofs[i]) = boundary_values[i];
+    right_hand_side(boundary_dofs[i]) =
+        diagonal(boundary_dofs[i]) * boundary_values[i];
+  }
+}
+
+template <int dim> void MatrixFreeWaveOperator<dim>::compute_diagonal() {
+  diagonal.reinit(m());
+
+  FEEvaluation<dim, -1> phi(*matrix_free);
+  AlignedVector<VectorizedArray<double>> local_diagonal(phi.dofs_per_cell);
+  for (unsigned int cell = 0; cell < matrix_free->n_cell_batches(); ++cell) {
+    phi.reinit(cell);
+    for (unsigned int i = 0; i < phi.dofs_per_cell; ++i) {
+      for (unsigned int j = 0; j < phi.dofs_per_cell; ++j)
+        phi.submit_dof_value(make_vectorized_array<double>(0.), j);
+      phi.submit_dof_value(make_vectorized_array<double>(1.), i);
+
+      do_quadrature(phi);
+      local_diagonal[i] = phi.get_dof_value(i);
+    }
+    for (unsigned int i = 0; i < phi.dofs_per_cell; ++i)
+      phi.submit_dof_value(local_diagonal[i], i);
+    phi.distribute_local_to_global(diagonal);
+  }
+
+  if (lumped_mass_factor != 0)
+    diagonal.add(lumped_mass_factor, *lumped_mass_matrix);
+  for (const auto dof : matrix_free->get_constrained_dofs())
+    diagonal(dof) = 1;
+}
+
+// @sect3{Run-time parameters}
+
+// The choices that distinguish one variant of the solver from another are
+// collected in the following structure. As in step-33, it knows how to
+// declare its entries in a ParameterHandler and how to read them back; if
+// no input file is given on the command line, the defaults declared here
+// are used.
+//
+// The first choice is the space dimension, which main() uses to select
+// the instantiation of the WaveEquation class, followed by the shape of
+// the cells and the polynomial degree of the finite element. In the
+// spectral element mode, the quadrature formula for all integrals uses the
+// Gauss-Lobatto points, which are also the support points of the FE_Q
+// element, so the local mass matrices become exactly diagonal. The degrees
+// of freedom can be renumbered after every call to
+// DoFHandler::distribute_dofs, so that coupled unknowns are also close in
+// memory. Next is whether the mass matrix is replaced, in both equations of
+// the $\theta$-scheme, by a diagonal ("lumped") matrix $M_L$ whose entries
+// are the row sums of $M$. With it, the second linear solve of every time
+// step turns into a multiplication by a precomputed inverse diagonal, and
+// the matrix of the first one becomes $M_L+k^2\theta^2A$. For spectral
+// elements, lumping is always switched on. On conforming meshes, their
+// mass matrix is already diagonal, and lumping changes nothing. With
+// hanging nodes, however, the condensed mass matrix $C^TMC$ couples the
+// degrees of freedom a constrained one depends on, and lumping is then an
+// approximation just as for other elements. In the same section, one can
+// choose to evaluate all operators matrix-free (see the
+// MatrixFreeWaveOperator class) rather than storing sparse matrices. This
+// is currently only implemented for the $\theta$-scheme and for the
+// preconditioners that only need the diagonal of the matrix. Assembled
+// matrices can additionally be stored in the SIMD-friendly format of the
+// SellCSigmaMatrix class for their matrix-vector products. Alternatively,
+// all matrices can be stored as SymmetricSparseMatrix objects that only
+// keep their upper triangles, on a shared pattern that replaces the full
+// one. With bilinear elements in 2D, this reduces the memory for matrices
+// and patterns to about 55 per cent. The mass and Laplace matrices can also
+// be stored interleaved in one InterleavedWaveMatrix, from which all
+// matrices of the $\theta$-scheme are formed on the fly. The products with
+// the latter, and the right hand side products with CSR matrices, can also
+// read their column indices in compressed form.
+//
+// The second set of choices determines the mesh: the number of global
+// refinements of the coarse mesh and of the adaptive refinement steps
+// before the actual computation starts, which together also bound the
+// refinement level of all cells. Simplex meshes can only be refined
+// globally, and the threshold given here decides when they are (see
+// WaveEquation::refine_mesh).
+//
+// The next choice is the time integrator: either the implicit
+// $\theta$-scheme discussed in the introduction, or the explicit leapfrog
+// scheme, whose time step is determined from the mesh size and the Courant
+// number given here. The third option is a local (multirate) variant of the
+// leapfrog scheme in which cells on finer refinement levels take
+// proportionally smaller time steps than the coarse ones.
+//
+// Finally, the implicit scheme has to solve linear systems with the
+// matrices $M+k^2\theta^2A$ and $M$ in every time step, and the
+// preconditioner used for the conjugate gradient method can be chosen here.
+// The geometric multigrid preconditioner is only available for the first of
+// these matrices; the mass matrix is then preconditioned with Jacobi. The
+// starting vector of the CG iteration can be extrapolated from the
+// solutions of the last few time steps, with the polynomial order given
+// here; zero means that CG simply starts from the previous solution.
+// The linear systems can also be solved in mixed precision, see
+// WaveEquation::solve_mixed_precision, and the equation for $U^n$ can
+// alternatively be solved with a sparse direct solver, or with a CG method
+// that recycles spectral information between time steps (see the
+// RecyclingCG class).
+struct Parameters {
+  enum class DoFOrdering {
+    none,
+    cuthill_mckee,
+    reverse_cuthill_mckee,
+    hierarchical
+  };
+  enum class OperatorEvaluation { matrix_based, matrix_free };
+  enum class MatrixFormat { csr, sell_c_sigma };
+  enum class TimeSteppingScheme { theta, leapfrog, local_leapfrog };
+  enum class PreconditionerType {
+    identity,
+    jacobi,
+    ssor,
+    chebyshev,
+    incomplete_cholesky,
+    multigrid
+  };
+
+  static void declare_parameters(ParameterHandler &prm);
+  void parse_parameters(ParameterHandler &prm);
+
+  unsigned int dimension;
+  bool simplex_mesh;
+  unsigned int fe_degree;
+  bool spectral_elements;
+  DoFOrdering dof_ordering;
+  bool mass_lumping;
+  OperatorEvaluation operator_evaluation;
+  MatrixFormat matrix_format;
+  bool symmetric_storage;
+  bool interleaved_storage;
+  bool compressed_column_indices;
+
+  unsigned int initial_global_refinement;
+  unsigned int n_adaptive_pre_refinement_steps;
+  double simplex_refinement_threshold;
+
+  TimeSteppingScheme time_stepping_scheme;
+  double courant_number;
+
+  PreconditionerType preconditioner;
+  unsigned int extrapolation_order;
+  bool mixed_precision;
+  bool direct_solver_u;
+  unsigned int deflation_space_dimension;
+};
+
+void Parameters::declare_parameters(ParameterHandler &prm) {
+  prm.enter_subsection("Discretization");
+  {
+    prm.declare_entry("Dimension", "2", Patterns::Integer(2, 3),
+                      "The space dimension of the problem.");
+    prm.declare_entry("Cell shape", "quadrilateral",
+                      Patterns::Selection("quadrilateral|simplex"),
+                      "Whether to use quadrilaterals (hexahedra in 3D) with "
+                      "FE_Q elements or triangles (tetrahedra) with "
+                      "FE_SimplexP elements. Simplex meshes are only refined "
+                      "globally, see the \"Mesh refinement\" section.");
+    prm.declare_entry("Polynomial degree", "1", Patterns::Integer(1, 8),
+                      "The polynomial degree of the FE_Q element, or of the "
+                      "FE_SimplexP element, which is only available for "
+                      "degrees 1 and 2.");
+    prm.declare_entry("Spectral elements", "false", Patterns::Bool(),
+                      "Whether to integrate with the Gauss-Lobatto "
+                      "quadrature collocated with the support points of the "
+                      "element, which makes the mass matrix diagonal on "
+                      "meshes without hanging nodes, and implies mass "
+                      "lumping.");
+    prm.declare_entry(
+        "DoF ordering", "none",
+        Patterns::Selection(
+            "none|Cuthill-McKee|reverse Cuthill-McKee|hierarchical"),
+        "How to renumber the degrees of freedom on every mesh. The "
+        "Cuthill-McKee orderings reduce the bandwidth of the matrices, the "
+        "hierarchical one numbers them along the Z-order curve of the mesh "
+        "hierarchy.");
+    prm.declare_entry("Mass lumping", "false", Patterns::Bool(),
+                      "Whether to replace the mass matrix in both equations "
+                      "of the theta scheme by the diagonal matrix of its "
+                      "row sums.");
+    prm.declare_entry("Operator evaluation", "matrix-based",
+                      Patterns::Selection("matrix-based|matrix-free"),
+                      "Whether to assemble sparse matrices or to apply the "
+                      "mass and Laplace operators cell by cell without "
+                      "storing them.");
+    prm.declare_entry("Sparse matrix format", "CSR",
+                      Patterns::Selection("CSR|SELL-C-sigma"),
+                      "The storage format used for the matrix-vector "
+                      "products of the time loop and the CG solvers with "
+                      "assembled matrices. SELL-C-sigma adds a second, "
+                      "SIMD-friendly copy of each matrix whose products are "
+                      "computed, which roughly doubles their memory. Not "
+                      "available with the mixed precision solver and the "
+                      "local leapfrog scheme, which do not use these "
+                      "copies.");
+    prm.declare_entry("Symmetric storage", "false", Patterns::Bool(),
+                      "Whether to store only the upper triangles of all "
+                      "matrices. Needs a Cuthill-McKee DoF ordering, is not "
+                      "available for the local leapfrog scheme, and, for "
+                      "the theta scheme, only with the identity, Jacobi, "
+                      "and Chebyshev preconditioners.");
+    prm.declare_entry("Interleaved storage", "false", Patterns::Bool(),
+                      "Whether to store the entries of the mass and Laplace "
+                      "matrices pairwise in one array and to form all "
+                      "linear combinations of them on the fly, instead of "
+                      "assembling the matrix for U separately. Only "
+                      "available for the theta scheme with the identity, "
+                      "Jacobi, and Chebyshev preconditioners.");
+    prm.declare_entry("Compressed column indices", "false", Patterns::Bool(),
+                      "Whether to read the column indices as 16-bit "
+                      "differences instead of from the sparsity pattern. "
+                      "Used by all products with interleaved matrices and, "
+                      "with CSR matrices, only by the right hand side "
+                      "products of the theta scheme with a consistent mass "
+                      "matrix. The sparsity pattern is kept in both cases, "
+                      "so this reduces memory traffic, not memory. Works "
+                      "best together with a bandwidth-reducing DoF "
+                      "ordering.");
+  }
+  prm.leave_subsection();
+
+  prm.enter_subsection("Mesh refinement");
+  {
+    prm.declare_entry("Initial global refinement", "4",
+                      Patterns::Integer(0, 12),
+                      "Number of global refinements of the coarse mesh. "
+                      "Converting the square into simplices already halves "
+                      "the mesh size, so a simplex mesh has the resolution "
+                      "of a quadrilateral mesh with one more refinement.");
+    prm.declare_entry("Adaptive pre-refinement steps", "4",
+                      Patterns::Integer(0, 12),
+                      "Number of refinement steps at the start of the "
+                      "computation. Cells are never refined beyond this "
+                      "many levels above the initial refinement.");
+    prm.declare_entry("Simplex refinement threshold", "0.",
+                      Patterns::Double(0.),
+                      "Simplex meshes are refined globally whenever the "
+                      "l2 norm of the Kelly error indicators exceeds this "
+                      "value.");
+  }
+  prm.leave_subsection();
+
+  prm.enter_subsection("Time stepping");
+  {
+    prm.declare_entry("Scheme", "theta",
+                      Patterns::Selection("theta|leapfrog|local leapfrog"),
+                      "The time integrator. 'leapfrog' is explicit, always "
+                      "uses a lumped mass matrix, and chooses its time step "
+                      "from the CFL condition. 'local leapfrog' does the "
+                      "same, but advances degrees of freedom on finer "
+                      "refinement levels with proportionally smaller steps.");
+    prm.declare_entry("Courant number", "0.5", Patterns::Double(0, 1),
+                      "Ratio of the time step of the explicit scheme to the "
+                      "largest stable time step estimated from the mesh. "
+                      "Must be positive.");
+  }
+  prm.leave_subsection();
+
+  prm.enter_subsection("Linear solvers");
+  {
+    prm.declare_entry(
+        "Preconditioner", "identity",
+        Patterns::Selection(
+            "identity|jacobi|ssor|chebyshev|incomplete cholesky|multigrid"),
+        "The preconditioner for the CG solvers of the implicit scheme. It is "
+        "set up once per mesh.");
+    prm.declare_entry("Initial guess extrapolation order", "0",
+                      Patterns::Integer(0, 3),
+                      "Polynomial order of the extrapolation from previous "
+                      "time steps that provides the starting vector for CG.");
+    prm.declare_entry("Mixed precision", "false", Patterns::Bool(),
+                      "Whether to run the CG iterations with single "
+                      "precision copies of the matrices, inside a double "
+                      "precision iterative refinement loop. Not available "
+                      "with the multigrid preconditioner.");
+    prm.declare_entry("Direct solver for u", "false", Patterns::Bool(),
+                      "Whether to factor the matrix of the equation for U "
+                      "once per mesh and solve with the factorization "
+                      "instead of CG. The factorization is an LU "
+                      "factorization by UMFPACK, which does not exploit the "
+                      "symmetry of the matrix and needs about twice the "
+                      "memory of a Cholesky factor. The other settings of "
+                      "this section then only apply to the equation for V.");
+    prm.declare_entry("Deflation space dimension", "0",
+                      Patterns::Integer(0, 64),
+                      "Number of approximate eigenvectors of the matrix for "
+                      "U that are kept from one time step to the next and "
+                      "deflated in the CG iteration. Zero disables "
+                      "deflation. Ignored for the mixed precision and direct "
+                      "solvers.");
+  }
+  prm.leave_subsection();
+}
+
+void Parameters::parse_parameters(ParameterHandler &prm) {
+  prm.enter_subsection("Discretization");
+  {
+    dimension = prm.get_integer("Dimension");
+    simplex_mesh = (prm.get("Cell shape") == "simplex");
+    fe_degree = prm.get_integer("Polynomial degree");
+    spectral_elements = prm.get_bool("Spectral elements");
+
+    const std::string ordering = prm.get("DoF ordering");
+    if (ordering == "none")
+      dof_ordering = DoFOrdering::none;
+    else if (ordering == "Cuthill-McKee")
+      dof_ordering = DoFOrdering::cuthill_mckee;
+    else if (ordering == "reverse Cuthill-McKee")
+      dof_ordering = DoFOrdering::reverse_cuthill_mckee;
+    else if (ordering == "hierarchical")
+      dof_ordering = DoFOrdering::hierarchical;
+    else
+      AssertThrow(false, ExcNotImplemented());
+
+    mass_lumping = prm.get_bool("Mass lumping") || spectral_elements;
+
+    const std::string evaluation = prm.get("Operator evaluation");
+    if (evaluation == "matrix-based")
+      operator_evaluation = OperatorEvaluation::matrix_based;
+    else if (evaluation == "matrix-free")
+      operator_evaluation = OperatorEvaluation::matrix_free;
+    else
+      AssertThrow(false, ExcNotImplemented());
+
+    const std::string format = prm.get("Sparse matrix format");
+    if (format == "CSR")
+      matrix_format = MatrixFormat::csr;
+    else if (format == "SELL-C-sigma")
+      matrix_format = MatrixFormat::sell_c_sigma;
+    else
+      AssertThrow(false, ExcNotImplemented());
+
+    symmetric_storage = prm.get_bool("Symmetric storage");
+    interleaved_storage = prm.get_bool("Interleaved storage");
+    compressed_column_indices = prm.get_bool("Compressed column indices");
+  }
+  prm.leave_subsection();
+
+  prm.enter_subsection("Mesh refinement");
+  {
+    initial_global_refinement = prm.get_integer("Initial global refinement");
+    n_adaptive_pre_refinement_steps =
+        prm.get_integer("Adaptive pre-refinement steps");
+    simplex_refinement_threshold =
+        prm.get_double("Simplex refinement threshold");
+  }
+  prm.leave_subsection();
+
+  prm.enter_subsection("Time stepping");
+  {
+    const std::string scheme = prm.get("Scheme");
+    if (scheme == "theta")
+      time_stepping_scheme = TimeSteppingScheme::theta;
+    else if (scheme == "leapfrog")
+      time_stepping_scheme = TimeSteppingScheme::leapfrog;
+    else if (scheme == "local leapfrog")
+      time_stepping_scheme = TimeSteppingScheme::local_leapfrog;
+    else
+      AssertThrow(false, ExcNotImplemented());
+
+    courant_number = prm.get_double("Courant number");
+    AssertThrow(courant_number > 0,
+                ExcMessage("The Courant number must be positive, since the "
+                           "explicit schemes would otherwise never advance "
+                           "in time."));
+  }
+  prm.leave_subsection();
+
+  prm.enter_subsection("Linear solvers");
+  {
+    const std::string name = prm.get("Preconditioner");
+    if (name == "identity")
+      preconditioner = PreconditionerType::identity;
+    else if (name == "jacobi")
+      preconditioner = PreconditionerType::jacobi;
+    else if (name == "ssor")
+      preconditioner = PreconditionerType::ssor;
+    else if (name == "chebyshev")
+      preconditioner = PreconditionerType::chebyshev;
+    else if (name == "incomplete cholesky")
+      preconditioner = PreconditionerType::incomplete_cholesky;
+    else if (name == "multigrid")
+      preconditioner = PreconditionerType::multigrid;
+    else
+      AssertThrow(false, ExcNotImplemented());
+
+    extrapolation_order = prm.get_integer("Initial guess extrapolation order");
+
+    mixed_precision = prm.get_bool("Mixed precision");
+    AssertThrow(!mixed_precision ||
+                    preconditioner != PreconditionerType::multigrid,
+                ExcMessage("The multigrid preconditioner is only implemented "
+                           "in double precision."));
+
+    direct_solver_u = prm.get_bool("Direct solver for u");
+    deflation_space_dimension = prm.get_integer("Deflation space dimension");
+  }
+  prm.leave_subsection();
+
+  if (simplex_mesh) {
+    AssertThrow(!spectral_elements,
+                ExcMessage("Spectral elements need tensor product cells."));
+    AssertThrow(operator_evaluation == OperatorEvaluation::matrix_based,
+                ExcMessage("The matrix-free operators are only implemented "
+                           "for tensor product cells."));
+    AssertThrow(preconditioner != PreconditionerType::multigrid,
+                ExcMessage("The multigrid preconditioner needs locally "
+                           "refined meshes, which are not available for "
+                           "simplices."));
+    AssertThrow(fe_degree <= 2,
+                ExcMessage("FE_SimplexP and QGaussSimplex are only "
+                           "implemented for low polynomial degrees, so "
+                           "simplex meshes are limited to degrees 1 and 2."));
+    AssertThrow(fe_degree == 1 ||
+                    (!mass_lumping &&
+                     time_stepping_scheme == TimeSteppingScheme::theta),
+                ExcMessage("The row sums of the mass matrix of higher order "
+                           "simplex elements are not all positive, so they "
+                           "can not be used with mass lumping or the "
+                           "explicit schemes."));
+  }
+
+  if (operator_evaluation == OperatorEvaluation::matrix_free) {
+    AssertThrow(time_stepping_scheme == TimeSteppingScheme::theta,
+                ExcMessage("Matrix-free operator evaluation is only "
+                           "implemented for the theta scheme."));
+    AssertThrow(preconditioner == PreconditionerType::identity ||
+                    preconditioner == PreconditionerType::jacobi ||
+                    preconditioner == PreconditionerType::chebyshev,
+                ExcMessage("Matrix-free operator evaluation only supports "
+                           "the identity, Jacobi, and Chebyshev "
+                           "preconditioners."));
+    AssertThrow(!mixed_precision && !direct_solver_u,
+                ExcMessage("The mixed precision and direct solvers need "
+                           "assembled matrices."));
+    AssertThrow(matrix_format == MatrixFormat::csr,
+                ExcMessage("The sparse matrix format only applies to "
+                           "assembled matrices."));
+  }
+
+  if (matrix_format == MatrixFormat::sell_c_sigma) {
+    AssertThrow(!mixed_precision,
+                ExcMessage("The mixed precision solver works on single "
+                           "precision copies of the CSR matrices and would "
+                           "not use the SELL-C-sigma copies."));
+    AssertThrow(time_stepping_scheme != TimeSteppingScheme::local_leapfrog,
+                ExcMessage("The local leapfrog scheme works on the rows of "
+                           "the CSR Laplace matrix and would not use the "
+                           "SELL-C-sigma copies."));
+  }
+
+  if (symmetric_storage) {
+    AssertThrow(operator_evaluation == OperatorEvaluation::matrix_based &&
+                    matrix_format == MatrixFormat::csr,
+                ExcMessage("Symmetric storage replaces the CSR matrices, so "
+                           "it needs assembled matrices in CSR format."));
+    AssertThrow(dof_ordering == DoFOrdering::cuthill_mckee ||
+                    dof_ordering == DoFOrdering::reverse_cuthill_mckee,
+                ExcMessage("The products with symmetric matrices can only "
+                           "work on as many rows in parallel as the "
+                           "bandwidth allows, so symmetric storage needs "
+                           "one of the Cuthill-McKee orderings."));
+    AssertThrow(time_stepping_scheme != TimeSteppingScheme::local_leapfrog,
+                ExcMessage("The local leapfrog scheme needs the rows of the "
+                           "full Laplace matrix."));
+    AssertThrow(time_stepping_scheme != TimeSteppingScheme::theta ||
+                    ((preconditioner == PreconditionerType::identity ||
+                      preconditioner == PreconditionerType::jacobi ||
+                      preconditioner == PreconditionerType::chebyshev) &&
+                     !mixed_precision && !direct_solver_u),
+                ExcMessage("With symmetric storage, there is no full matrix "
+                           "to build an SSOR, incomplete Cholesky, "
+                           "multigrid, single precision, or direct solver "
+                           "from."));
+  }
+
+  if (interleaved_storage) {
+    AssertThrow(operator_evaluation == OperatorEvaluation::matrix_based &&
+                    matrix_format == MatrixFormat::csr && !symmetric_storage,
+                ExcMessage("Interleaved storage replaces the CSR matrices, "
+                           "so it can not be combined with matrix-free "
+                           "evaluation or the other storage formats."));
+    AssertThrow(time_stepping_scheme == TimeSteppingScheme::theta,
+                ExcMessage("Interleaved storage is only implemented for the "
+                           "theta scheme."));
+    AssertThrow((preconditioner == PreconditionerType::identity ||
+                 preconditioner == PreconditionerType::jacobi ||
+                 preconditioner == PreconditionerType::chebyshev) &&
+                    !mixed_precision && !direct_solver_u,
+                ExcMessage("With interleaved storage, there is no matrix for "
+                           "U to build an SSOR, incomplete Cholesky, "
+                           "multigrid, single precision, or direct solver "
+                           "from."));
+  }
+
+  AssertThrow(!compressed_column_indices || interleaved_storage ||
+                  (operator_evaluation == OperatorEvaluation::matrix_based &&
+                   matrix_format == MatrixFormat::csr && !symmetric_storage &&
+                   time_stepping_scheme == TimeSteppingScheme::theta &&
+                   !mass_lumping),
+              ExcMessage("Compressed column indices are only used by the "
+                         "products with interleaved matrices and by the "
+                         "fused right hand side products of the theta "
+                         "scheme with CSR matrices and a consistent mass "
+                         "matrix."));
+}
+
+// @sect3{The <code>SelectablePreconditioner</code> class}
+
+// The CG solvers need a preconditioner whose type is only known at run
+// time. The following class holds one object of each of the preconditioner
+// classes we support and forwards <code>vmult</code> to the one that was
+// selected in <code>initialize</code>. All of them are built from the
+// matrix without boundary values applied; since boundary rows only differ
+// from it in their off-diagonal entries, this is still a good (and
+// symmetric positive definite) approximation of the inverse of the masked
+// operator. The "incomplete Cholesky" choice is the modified incomplete
+// Cholesky decomposition SparseMIC. The multigrid preconditioner needs the
+// whole mesh hierarchy rather than just a matrix and is therefore set up
+// separately by WaveEquation::setup_multigrid. The class is templated on
+// the number type of the matrix and the vectors it works on, so that it can
+// also be used for the single precision solves.
+template <typename number> class SelectablePreconditioner {
+public:
+  void initialize(const SparseMatrix<number> &matrix,
+                  const Parameters::PreconditionerType type);
+
+  void vmult(Vector<number> &dst, const Vector<number> &src) const;
+
+private:
+  Parameters::PreconditionerType type;
+
+  PreconditionJacobi<SparseMatrix<number>> jacobi;
+  PreconditionSSOR<SparseMatrix<number>> ssor;
+  PreconditionChebyshev<SparseMatrix<number>, Vector<number>> chebyshev;
+  SparseMIC<number> incomplete_cholesky;
+};
+
+template <typename number>
+void SelectablePreconditioner<number>::initialize(
+    const SparseMatrix<number> &matrix,
+    const Parameters::PreconditionerType type) {
+  this->type = type;
+
+  switch (type) {
+  case Parameters::PreconditionerType::identity:
+    break;
+
+  case Parameters::PreconditionerType::jacobi:
+    jacobi.initialize(matrix);
+    break;
+
+  case Parameters::PreconditionerType::ssor:
+    ssor.initialize(matrix, 1.2);
+    break;
+
+  case Parameters::PreconditionerType::chebyshev: {
+    typename PreconditionChebyshev<SparseMatrix<number>,
+                                   Vector<number>>::AdditionalData data;
+    data.degree = 4;
+    data.smoothing_range = 20;
+    data.preconditioner = std::make_shared<DiagonalMatrix<Vector<number>>>();
+    data.preconditioner->get_vector().reinit(matrix.m());
+    for (unsigned int i = 0; i < matrix.m(); ++i)
+      data.preconditioner->get_vector()(i) = 1. / matrix.diag_element(i);
+    chebyshev.initialize(matrix, data);
+    break;
+  }
+
+  case Parameters::PreconditionerType::incomplete_cholesky:
+    incomplete_cholesky.initialize(matrix);
+    break;
+
+  default:
+    Assert(false, ExcNotImplemented());
+  }
+}
+
+template <typename number>
+void SelectablePreconditioner<number>::vmult(Vector<number> &dst,
+                                             const Vector<number> &src) const {
+  switch (type) {
+  case Parameters::PreconditionerType::identity:
+    dst = src;
+    break;
+  case Parameters::PreconditionerType::jacobi:
+    jacobi.vmult(dst, src);
+    break;
+  case Parameters::PreconditionerType::ssor:
+    ssor.vmult(dst, src);
+    break;
+  case Parameters::PreconditionerType::chebyshev:
+    chebyshev.vmult(dst, src);
+    break;
+  case Parameters::PreconditionerType::incomplete_cholesky:
+    incomplete_cholesky.vmult(dst, src);
+    break;
+  default:
+    Assert(false, ExcNotImplemented());
+  }
+}
+
+// For the matrix-free operators, only preconditioners that can be built
+// from the diagonal of the operator are available. The following class
+// plays the same role for them as SelectablePreconditioner does for sparse
+// matrices. It is also used for the combinations of an
+// InterleavedWaveMatrix and for the SymmetricSparseMatrix objects, which are
+// not SparseMatrix objects either:
+template <typename OperatorType> class MatrixFreePreconditioner {
+public:
+  void initialize(const OperatorType &op,
+                  const Parameters::PreconditionerType type);
+
+  void vmult(Vector<double> &dst, const Vector<double> &src) const;
+
+private:
+  Parameters::PreconditionerType type;
+
+  DiagonalMatrix<Vector<double>> jacobi;
+  PreconditionChebyshev<OperatorType, Vector<double>> chebyshev;
+};
+
+template <typename OperatorType>
+void MatrixFreePreconditioner<OperatorType>::initialize(
+    const OperatorType &op, const Parameters::PreconditionerType type) {
+  this->type = type;
+
+  switch (type) {
+  case Parameters::PreconditionerType::identity:
+    break;
+
+  case Parameters::PreconditionerType::jacobi:
+    jacobi.get_vector().reinit(op.m());
+    for (unsigned int i = 0; i < op.m(); ++i)
+      jacobi.get_vector()(i) = 1. / op.get_diagonal()(i);
+    break;
+
+  case Parameters::PreconditionerType::chebyshev: {
+    typename PreconditionChebyshev<OperatorType,
+                                   Vector<double>>::AdditionalData data;
+    data.degree = 4;
+    data.smoothing_range = 20;
+    data.preconditioner = std::make_shared<DiagonalMatrix<Vector<double>>>();
+    data.preconditioner->get_vector().reinit(op.m());
+    for (unsigned int i = 0; i < op.m(); ++i)
+      data.preconditioner->get_vector()(i) = 1. / op.get_diagonal()(i);
+    chebyshev.initialize(op, data);
+    break;
+  }
+
+  default:
+    AssertThrow(false, ExcNotImplemented());
+  }
+}
+
+template <typename OperatorType>
+void MatrixFreePreconditioner<OperatorType>::vmult(
+    Vector<double> &dst, const Vector<double> &src) const {
+  switch (type) {
+  case Parameters::PreconditionerType::identity:
+    dst = src;
+    break;
+  case Parameters::PreconditionerType::jacobi:
+    jacobi.vmult(dst, src);
+    break;
+  case Parameters::PreconditionerType::chebyshev:
+    chebyshev.vmult(dst, src);
+    break;
+  default:
+    Assert(false, ExcNotImplemented());
+  }
+}
+
+// @sect3{The <code>RecyclingCG</code> class}
+
+// Between two mesh refinements, the equation for $U^n$ is solved in every
+// time step with the same matrix and a slowly changing right hand side. A
+// plain CG iteration starts from scratch every time, and in particular has
+// to rediscover the eigenvectors belonging to the smallest eigenvalues of
+// the matrix, which are what slows its convergence down. The following
+// class implements a deflated CG method that keeps $k$ approximations of
+// these eigenvectors, the columns of a matrix $W$, from one solve to the
+// next. The iteration is then restricted to the $A$-orthogonal complement
+// of the span of $W$: the initial guess is corrected such that the initial
+// residual is orthogonal to $W$, and the component along $W$ is projected
+// out of every new search direction, $p_{j+1} = z_{j+1} + \beta_j p_j -
+// W(W^TAW)^{-1}(AW)^Tz_{j+1}$. (See Saad, Yeung, Erhel, and Guyomarc'h, "A
+// deflated version of the conjugate gradient algorithm", SIAM J. Sci.
+// Comput., 2000.)
+//
+// The approximate eigenvectors are updated after every solve by a
+// Rayleigh-Ritz procedure on the space spanned by the old vectors $W$ and
+// the first $k$ search directions of the current solve: after
+// orthonormalizing these vectors, we compute the eigenpairs of the small
+// matrix $Z^TAZ$ and keep the $k$ Ritz vectors with the smallest Ritz
+// values. Because we carry the products with $A$ of all of these vectors
+// along (the ones of the search directions are computed by CG anyway), this
+// needs no additional matrix-vector products. Since the Ritz vectors are
+// orthonormal and $W^TAW$ is the diagonal matrix of Ritz values, applying
+// $(W^TAW)^{-1}$ is trivial. The small eigenvalue problem is solved with
+// LAPACK.
+//
+// The stored vectors are only valid for the matrix they were computed
+// with, so they have to be discarded with <code>clear()</code> whenever the
+// mesh changes. The interface of the <code>solve</code> function is
+// modeled on the one of the SolverCG class.
+class RecyclingCG {
+public:
+  RecyclingCG(const unsigned int n_deflation_vectors);
+
+  void clear();
+
+  template <typename MatrixType, typename PreconditionerType>
+  void solve(SolverControl &solver_control, const MatrixType &matrix,
+             Vector<double> &solution, const Vector<double> &right_hand_side,
+             const PreconditionerType &preconditioner);
+
+private:
+  void update_deflation_space();
+
+  const unsigned int n_deflation_vectors;
 
-// Here are the only three include files of some new interest: The first one
-// is already used, for example, for the
-// VectorTools::interpolate_boundary_values and
-// MatrixTools::apply_boundary_values functions. However, we here use another
-// function in that class, VectorTools::project to compute our initial values
-// as the $L^2$ projection of the continuous initial values. Furthermore, we
-// use VectorTools::create_right_hand_side to generate the integrals
-// $(f^n,\phi^n_i)$. These were previously always generated by hand in
-// <code>assemble_system</code> or similar functions in application
-// code. However, we're too lazy to do that here, so simply use a library
-// function:
-#include <deal.II/numerics/vector_tools.h>
+  std::vector<Vector<double>> deflation_vectors;
+  std::vector<Vector<double>> deflation_vector_products;
+  std::vector<double> ritz_values;
 
-// In a very similar vein, we are also too lazy to write the code to assemble
-// mass and Laplace matrices, although it would have only taken copying the
-// relevant code from any number of previous tutorial programs. Rather, we
-// want to focus on the things that are truly new to this program and
-// therefore use the MatrixCreator::create_mass_matrix and
-// MatrixCreator::create_laplace_matrix functions. They are declared here:
-#include <deal.II/numerics/matrix_tools.h>
+  std::vector<Vector<double>> search_directions;
+  std::vector<Vector<double>> search_direction_products;
+};
 
-// Finally, here is an include file that contains all sorts of tool functions
-// that one sometimes needs. In particular, we need the
-// Utilities::int_to_string class that, given an integer argument, returns a
-// string representation of it. It is particularly useful since it allows for
-// a second parameter indicating the number of digits to which we want the
-// result padded with leading zeros. We will use this to write output files
-// that have the form <code>solution-XXX.vtu</code> where <code>XXX</code>
-// denotes the number of the time step and always consists of three digits
-// even if we are still in the single or double digit time steps.
-#include <deal.II/base/utilities.h>
+RecyclingCG::RecyclingCG(const unsigned int n_deflation_vectors)
+    : n_deflation_vectors(n_deflation_vectors) {}
 
-// AMR
-#include <deal.II/grid/grid_refinement.h>
-#include <deal.II/numerics/error_estimator.h>
-#include <deal.II/numerics/solution_transfer.h>
+void RecyclingCG::clear() {
+  deflation_vectors.clear();
+  deflation_vector_products.clear();
+  ritz_values.clear();
+}
 
-#include <chrono>
+template <typename MatrixType, typename PreconditionerType>
+void RecyclingCG::solve(SolverControl &solver_control,
+                        const MatrixType &matrix, Vector<double> &solution,
+                        const Vector<double> &right_hand_side,
+                        const PreconditionerType &preconditioner) {
+  Vector<double> residual(solution.size());
+  Vector<double> preconditioned_residual(solution.size());
+  Vector<double> direction(solution.size());
+  Vector<double> matrix_times_direction(solution.size());
 
-// The last step is as in all previous programs:
-namespace Step23 {
-using namespace dealii;
+  // Start by making the initial residual orthogonal to the deflation
+  // space, $x_0 \leftarrow x_0 + W(W^TAW)^{-1}W^Tr_0$:
+  matrix.vmult(residual, solution);
+  residual.sadd(-1., right_hand_side);
+
+  std::vector<double> coefficients(deflation_vectors.size());
+  for (unsigned int i = 0; i < deflation_vectors.size(); ++i)
+    coefficients[i] = (deflation_vectors[i] * residual) / ritz_values[i];
+  for (unsigned int i = 0; i < deflation_vectors.size(); ++i) {
+    solution.add(coefficients[i], deflation_vectors[i]);
+    residual.add(-coefficients[i], deflation_vector_products[i]);
+  }
+
+  const auto project_out_deflation_space = [&](const Vector<double> &z,
+                                               Vector<double> &p) {
+    for (unsigned int i = 0; i < deflation_vectors.size(); ++i)
+      p.add(-(deflation_vector_products[i] * z) / ritz_values[i],
+            deflation_vectors[i]);
+  };
+
+  search_directions.clear();
+  search_direction_products.clear();
+
+  unsigned int step = 0;
+  SolverControl::State state = solver_control.check(step, residual.l2_norm());
+  if (state == SolverControl::iterate) {
+    preconditioner.vmult(preconditioned_residual, residual);
+    direction = preconditioned_residual;
+    project_out_deflation_space(preconditioned_residual, direction);
+  }
+  double residual_dot_preconditioned = residual * preconditioned_residual;
+
+  while (state == SolverControl::iterate) {
+    matrix.vmult(matrix_times_direction, direction);
+    const double alpha =
+        residual_dot_preconditioned / (direction * matrix_times_direction);
+    solution.add(alpha, direction);
+    residual.add(-alpha, matrix_times_direction);
+
+    if (search_directions.size() < n_deflation_vectors) {
+      search_directions.push_back(direction);
+      search_direction_products.push_back(matrix_times_direction);
+    }
+
+    state = solver_control.check(++step, residual.l2_norm());
+    if (state != SolverControl::iterate)
+      break;
+
+    preconditioner.vmult(preconditioned_residual, residual);
+    const double old_residual_dot_preconditioned = residual_dot_preconditioned;
+    residual_dot_preconditioned = residual * preconditioned_residual;
+    direction.sadd(residual_dot_preconditioned /
+                       old_residual_dot_preconditioned,
+                   preconditioned_residual);
+    project_out_deflation_space(preconditioned_residual, direction);
+  }
+
+  update_deflation_space();
+
+  AssertThrow(state == SolverControl::success,
+              SolverControl::NoConvergence(solver_control.last_step(),
+                                           solver_control.last_value()));
+}
+
+void RecyclingCG::update_deflation_space() {
+  std::vector<Vector<double>> basis, basis_products;
+  for (unsigned int i = 0; i < deflation_vectors.size(); ++i) {
+    basis.push_back(std::move(deflation_vectors[i]));
+    basis_products.push_back(std::move(deflation_vector_products[i]));
+  }
+  for (unsigned int i = 0; i < search_directions.size(); ++i) {
+    basis.push_back(std::move(search_directions[i]));
+    basis_products.push_back(std::move(search_direction_products[i]));
+  }
+  search_directions.clear();
+  search_direction_products.clear();
+
+  // Orthonormalize the candidate vectors with the modified Gram-Schmidt
+  // method, applying the same operations to their products with $A$ and
+  // dropping vectors that are (numerically) linearly dependent on the
+  // previous ones:
+  unsigned int n_basis_vectors = 0;
+  for (unsigned int i = 0; i < basis.size(); ++i) {
+    const double original_norm = basis[i].l2_norm();
+    for (unsigned int j = 0; j < n_basis_vectors; ++j) {
+      const double coefficient = basis[i] * basis[j];
+      basis[i].add(-coefficient, basis[j]);
+      basis_products[i].add(-coefficient, basis_products[j]);
+    }
+    const double norm = basis[i].l2_norm();
+    if (norm <= 1e-10 * original_norm)
+      continue;
+
+    basis[i] /= norm;
+    basis_products[i] /= norm;
+    if (i != n_basis_vectors) {
+      basis[n_basis_vectors] = std::move(basis[i]);
+      basis_products[n_basis_vectors] = std::move(basis_products[i]);
+    }
+    ++n_basis_vectors;
+  }
+
+  deflation_vectors.clear();
+  deflation_vector_products.clear();
+  ritz_values.clear();
+  if (n_basis_vectors == 0)
+    return;
+
+  // Then set up the projected matrix $Z^TAZ$ and compute its eigenpairs.
+  // The matrix is symmetric and positive definite, so all of its
+  // eigenvalues lie between zero and the largest Gershgorin bound:
+  LAPACKFullMatrix<double> projected_matrix(n_basis_vectors);
+  double upper_bound = 0;
+  for (unsigned int i = 0; i < n_basis_vectors; ++i) {
+    double row_sum = 0;
+    for (unsigned int j = 0; j < n_basis_vectors; ++j) {
+      projected_matrix(i, j) = 0.5 * (basis[i] * basis_products[j] +
+                                      basis[j] * basis_products[i]);
+      row_sum += std::abs(projected_matrix(i, j));
+    }
+    upper_bound = std::max(upper_bound, row_sum);
+  }
+
+  Vector<double> eigenvalues;
+  FullMatrix<double> eigenvectors;
+  projected_matrix.compute_eigenvalues_symmetric(0, 1.01 * upper_bound, 0,
+                                                 eigenvalues, eigenvectors);
+
+  // The eigenvalues come sorted in ascending order, so the first $k$ of
+  // them belong to the Ritz vectors we want to keep:
+  const unsigned int n_kept = std::min<unsigned int>(
+      n_deflation_vectors, eigenvalues.size());
+  deflation_vectors.resize(n_kept);
+  deflation_vector_products.resize(n_kept);
+  ritz_values.resize(n_kept);
+  for (unsigned int k = 0; k < n_kept; ++k) {
+    deflation_vectors[k].reinit(basis[0].size());
+    deflation_vector_products[k].reinit(basis[0].size());
+    for (unsigned int i = 0; i < n_basis_vectors; ++i) {
+      deflation_vectors[k].add(eigenvectors(i, k), basis[i]);
+      deflation_vector_products[k].add(eigenvectors(i, k), basis_products[i]);
+    }
+    ritz_values[k] = eigenvalues(k);
+  }
+}
 
 // @sect3{The <code>WaveEquation</code> class}
 
 // Next comes the declaration of the main class. It's public interface of
 // functions is like in most of the other tutorial programs. Worth
-// mentioning is that we now have to store four matrices instead of one: the
-// mass matrix $M$, the Laplace matrix $A$, the matrix $M+k^2\theta^2A$ used
-// for solving for $U^n$, and a copy of the mass matrix with boundary
-// conditions applied used for solving for $V^n$. Note that it is a bit
-// wasteful to have an additional copy of the mass matrix around. We will
-// discuss strategies for how to avoid this in the section on possible
-// improvements.
+// mentioning is that we now have to store three matrices instead of one: the
+// mass matrix $M$, the Laplace matrix $A$, and the matrix $M+k^2\theta^2A$
+// used for solving for $U^n$. The latter is built only once per mesh in
+// <code>setup_system</code> and is then only ever used through
+// <code>system_matrix_u</code>, which applies the boundary rows stored in
+// <code>boundary_dofs</code> without touching the matrix. In the same way,
+// <code>system_matrix_v</code> presents the mass matrix with boundary
+// conditions applied for solving for $V^n$, so that we do not need to keep
+// an additional copy of the mass matrix around. If mass lumping is
+// requested, we do not solve for $V^n$ at all but multiply by the inverse
+// of the lumped mass matrix, whose diagonal we store in
+// <code>inverse_lumped_mass_matrix</code>.
+//
+// How a single time step is done is left to one of the time integrator
+// functions <code>do_theta_step</code>, <code>do_leapfrog_step</code> and
+// <code>do_local_leapfrog_step</code>; all of them use the forcing terms at
+// the old and new time computed by <code>assemble_forcing_terms</code>. The
+// local time stepping scheme additionally needs to know which degrees of
+// freedom belong to which refinement level; this information is kept in
+// the <code>lts_</code> member variables.
+//
+// The boundary degrees of freedom and the spatial profiles of the boundary
+// values at their support points are computed once per mesh, too, and
+// stored as flat arrays; <code>compute_boundary_values</code> turns them
+// into the boundary values at the current time.
+//
+// The preconditioners for the two linear systems of the implicit scheme
+// only depend on the matrices and are therefore also rebuilt only when the
+// mesh changes. To compare the different choices, we accumulate the CG
+// iterations and the time spent in the solvers over the whole run. For the
+// mixed precision solver, we keep single precision copies of the two
+// matrices, together with their own boundary masking and preconditioner
+// objects; these carry the suffix <code>_float</code>. Likewise, the copies
+// of the matrices in the SELL-$C$-$\sigma$ format carry the suffix
+// <code>_sell</code>, and the ones that only store the upper triangle the
+// suffix <code>_symmetric</code>. With interleaved storage, the mass and
+// Laplace matrices live in <code>wave_matrix</code>, and the matrices of the
+// two equations are the combinations <code>wave_matrix_u</code> and
+// <code>wave_matrix_v</code> of it, with the suffix
+// <code>_interleaved</code> for the objects built on them. If the equation
+// for $U^n$ is to be solved directly, the factorization of its matrix is
+// kept in <code>direct_solver_u</code>, and the approximate eigenvectors
+// recycled from one CG solve to the next in <code>recycling_cg_u</code>.
+// The multigrid preconditioner consists of a whole family of objects, all of
+// which have the prefix <code>mg_</code>; they are built in
+// <code>setup_multigrid</code>.
+//
+// If the operators are evaluated matrix-free, none of the sparse matrices
+// are built. Instead, the MatrixFree object holding the precomputed data
+// of all cells is shared between the operators $M$, $A$, and
+// $M+k^2\theta^2A$, which carry the prefix <code>matrix_free_</code>.
 //
 // Likewise, we need solution vectors for $U^n,V^n$ as well as for the
 // corresponding vectors at the previous time step, $U^{n-1},V^{n-1}$. The
 // <code>system_rhs</code> will be used for whatever right hand side vector
 // we have when solving one of the two linear systems in each time
 // step. These will be solved in the two functions <code>solve_u</code> and
-// <code>solve_v</code>.
+// <code>solve_v</code>. To give these solvers a good starting guess, we
+// also keep the last few solutions, newest first, in
+// <code>solution_history_u</code> and <code>solution_history_v</code>.
 //
 // Finally, the variable <code>theta</code> is used to indicate the
 // parameter $\theta$ that is used to define which time stepping scheme to
 // use, as explained in the introduction. The rest is self-explanatory.
 template <int dim> class WaveEquation {
 public:
-  WaveEquation();
+  WaveEquation(const Parameters &parameters);
   void run();
 
 private:
   void setup_system();
+  void assemble_matrices();
+  void report_matrix_structure();
+  void compute_lumped_mass_matrix();
+  void assemble_forcing_terms();
+  void compute_boundary_values();
+  void set_boundary_values(const std::vector<double> &boundary_values,
+                           Vector<double> &vector) const;
+  void do_theta_step();
+  void do_leapfrog_step();
+  void do_local_leapfrog_step();
+  void setup_local_time_stepping();
+  void compute_local_increment(const unsigned int level,
+                               const Vector<double> &z,
+                               const Vector<double> &f, const double tau,
+                               Vector<double> &increment);
+  void compute_local_leapfrog_increment(const Vector<double> &u,
+                                        const Vector<double> &forcing,
+                                        Vector<double> &increment);
   void solve_u();
   void solve_v();
+  unsigned int solve_mixed_precision(
+      const BoundaryMaskedMatrix<SparseMatrix<double>> &matrix,
+      const BoundaryMaskedMatrix<SparseMatrix<float>> &matrix_float,
+      const SelectablePreconditioner<float> &preconditioner_float,
+      Vector<double> &solution, const Vector<double> &right_hand_side) const;
+  void setup_multigrid();
+  void factorize_matrix_u();
+  void setup_matrix_free();
+  void update_solution_history();
+  void extrapolate_from_history(const std::deque<Vector<double>> &history,
+                                Vector<double> &prediction) const;
   void refine_mesh(const unsigned int min_grid_level,
                    const unsigned int max_grid_level);
   void output_results() const;
 
+  const Parameters parameters;
+
   Triangulation<dim> triangulation;
   Triangulation<dim> Th;
-  FE_Q<dim> fe;
-  //  FE_SimplexP<dim> fe;
+  std::unique_ptr<FiniteElement<dim>> fe;
+  std::unique_ptr<Mapping<dim>> mapping;
+  const Quadrature<1> quadrature_1d;
+  Quadrature<dim> quadrature;
+  Quadrature<dim - 1> face_quadrature;
   DoFHandler<dim> dof_handler;
 
   AffineConstraints<double> constraints;
@@ -136,11 +2302,89 @@ private:
   SparseMatrix<double> mass_matrix;
   SparseMatrix<double> laplace_matrix;
   SparseMatrix<double> matrix_u;
-  SparseMatrix<double> matrix_v;
+  DeltaCompressedColumnIndices compressed_column_indices;
+
+  std::vector<types::global_dof_index> boundary_dofs;
+  std::vector<double> boundary_profile_u, boundary_profile_v;
+  std::vector<double> boundary_values_u, boundary_values_v;
+  BoundaryMaskedMatrix<SparseMatrix<double>> system_matrix_u;
+  BoundaryMaskedMatrix<SparseMatrix<double>> system_matrix_v;
+  SelectablePreconditioner<double> preconditioner_u, preconditioner_v;
+  SellCSigmaMatrix<double> mass_matrix_sell, laplace_matrix_sell,
+      matrix_u_sell;
+  BoundaryMaskedMatrix<SellCSigmaMatrix<double>> system_matrix_u_sell;
+  BoundaryMaskedMatrix<SellCSigmaMatrix<double>> system_matrix_v_sell;
+  SymmetricSparsityPattern sparsity_pattern_symmetric;
+  SymmetricSparseMatrix<double> mass_matrix_symmetric,
+      laplace_matrix_symmetric, matrix_u_symmetric;
+  BoundaryMaskedMatrix<SymmetricSparseMatrix<double>>
+      system_matrix_u_symmetric;
+  BoundaryMaskedMatrix<SymmetricSparseMatrix<double>>
+      system_matrix_v_symmetric;
+  MatrixFreePreconditioner<SymmetricSparseMatrix<double>>
+      preconditioner_u_symmetric, preconditioner_v_symmetric;
+  InterleavedWaveMatrix<double> wave_matrix;
+  WaveMatrixCombination<double> wave_matrix_u, wave_matrix_v;
+  BoundaryMaskedMatrix<WaveMatrixCombination<double>>
+      system_matrix_u_interleaved;
+  BoundaryMaskedMatrix<WaveMatrixCombination<double>>
+      system_matrix_v_interleaved;
+  MatrixFreePreconditioner<WaveMatrixCombination<double>>
+      preconditioner_u_interleaved, preconditioner_v_interleaved;
+  SparseMatrix<float> matrix_u_float, mass_matrix_float;
+  BoundaryMaskedMatrix<SparseMatrix<float>> system_matrix_u_float;
+  BoundaryMaskedMatrix<SparseMatrix<float>> system_matrix_v_float;
+  SelectablePreconditioner<float> preconditioner_u_float,
+      preconditioner_v_float;
+  SparseDirectUMFPACK direct_solver_u;
+  RecyclingCG recycling_cg_u;
+  unsigned int total_iterations_u, total_iterations_v;
+  double total_solve_time_u, total_solve_time_v;
+
+  MGConstrainedDoFs mg_constrained_dofs;
+  MGLevelObject<SparsityPattern> mg_sparsity_patterns;
+  MGLevelObject<SparseMatrix<double>> mg_matrices;
+  MGLevelObject<SparseMatrix<double>> mg_interface_matrices;
+  FullMatrix<double> mg_coarse_matrix;
+  std::unique_ptr<MGTransferPrebuilt<Vector<double>>> mg_transfer;
+  std::unique_ptr<MGCoarseGridHouseholder<double, Vector<double>>>
+      mg_coarse_solver;
+  std::unique_ptr<mg::SmootherRelaxation<PreconditionSOR<SparseMatrix<double>>,
+                                         Vector<double>>>
+      mg_smoother;
+  std::unique_ptr<mg::Matrix<Vector<double>>> mg_matrix, mg_interface_up,
+      mg_interface_down;
+  std::unique_ptr<Multigrid<Vector<double>>> mg;
+  std::unique_ptr<
+      PreconditionMG<dim, Vector<double>, MGTransferPrebuilt<Vector<double>>>>
+      mg_preconditioner;
+
+  std::shared_ptr<MatrixFree<dim, double>> matrix_free;
+  MatrixFreeWaveOperator<dim> matrix_free_mass, matrix_free_laplace,
+      matrix_free_u;
+  MatrixFreePreconditioner<MatrixFreeWaveOperator<dim>>
+      matrix_free_preconditioner_u, matrix_free_preconditioner_v;
+
+  Vector<double> lumped_mass_matrix;
+  Vector<double> inverse_lumped_mass_matrix;
 
   Vector<double> solution_u, solution_v;
   Vector<double> old_solution_u, old_solution_v;
+  std::deque<Vector<double>> solution_history_u, solution_history_v;
   Vector<double> system_rhs;
+  Vector<double> forcing_term_new, forcing_term_old;
+  unsigned int forcing_term_timestep_number;
+  bool forcing_is_zero;
+  Vector<double> forcing_terms;
+  Vector<double> tmp;
+  Vector<double> mass_times_old_u, mass_times_old_v, laplace_times_old_u;
+
+  std::vector<std::vector<types::global_dof_index>> lts_group_dofs;
+  std::vector<std::vector<types::global_dof_index>> lts_active_dofs;
+  std::vector<Vector<double>> lts_forcing, lts_substep_solution,
+      lts_substep_increment;
+  Vector<double> lts_increment;
+  bool lts_increment_valid;
 
   double time_step;
   double time;
@@ -180,7 +2424,11 @@ public:
 };
 
 // Secondly, we have the right hand side forcing term. Boring as we are, we
-// choose zero here as well:
+// choose zero here as well. Since integrating a function that is known to
+// be zero is a waste of time, the class also says so through the
+// <code>is_identically_zero</code> function; a forcing term that is not
+// zero everywhere and at all times would have to return <code>false</code>
+// there:
 template <int dim> class RightHandSide : public Function<dim> {
 public:
   virtual double value(const Point<dim> & /*p*/,
@@ -189,137 +2437,949 @@ public:
     Assert(component == 0, ExcIndexRange(component, 0, 1));
     return 0;
   }
+
+  bool is_identically_zero() const { return true; }
+};
+
+// Finally, we have boundary values for $u$ and $v$. They are as described
+// in the introduction, one being the time derivative of the other. Both
+// are of the form $g(\mathbf x,t) = s(\mathbf x)\,\tau(t)$ with a spatial
+// profile $s$ that does not depend on time. We make this structure
+// explicit through a common base class: the spatial profile only needs to
+// be evaluated once per mesh at the boundary support points, after which
+// the boundary values at any time are just that profile times a scalar
+// (see WaveEquation::compute_boundary_values below). The
+// <code>value</code> function is still there for everything else that
+// needs to evaluate the boundary values as a Function object.
+template <int dim> class SeparableBoundaryValues : public Function<dim> {
+public:
+  virtual double spatial_profile(const Point<dim> &p) const = 0;
+  virtual double time_profile(const double t) const = 0;
+
+  virtual double value(const Point<dim> &p,
+                       const unsigned int component = 0) const override {
+    (void)component;
+    Assert(component == 0, ExcIndexRange(component, 0, 1));
+
+    return spatial_profile(p) * time_profile(this->get_time());
+  }
+};
+
+template <int dim>
+class BoundaryValuesU : public SeparableBoundaryValues<dim> {
+public:
+  virtual double spatial_profile(const Point<dim> &p) const override {
+    if ((p[0] < 0) && (p[1] < 1. / 3) && (p[1] > -1. / 3))
+      return 1;
+    else
+      return 0;
+  }
+
+  virtual double time_profile(const double t) const override {
+    if (t <= 0.5)
+      return std::sin(t * 4 * numbers::PI);
+    else
+      return 0;
+  }
+};
+
+template <int dim>
+class BoundaryValuesV : public SeparableBoundaryValues<dim> {
+public:
+  virtual double spatial_profile(const Point<dim> &p) const override {
+    if ((p[0] < 0) && (p[1] < 1. / 3) && (p[1] > -1. / 3))
+      return 1;
+    else
+      return 0;
+  }
+
+  virtual double time_profile(const double t) const override {
+    if (t <= 0.5)
+      return (std::cos(t * 4 * numbers::PI) * 4 * numbers::PI);
+    else
+      return 0;
+  }
 };
 
-// Finally, we have boundary values for $u$ and $v$. They are as described
-// in the introduction, one being the time derivative of the other:
-template <int dim> class BoundaryValuesU : public Function<dim> {
-public:
-  virtual double value(const Point<dim> &p,
-                       const unsigned int component = 0) const override {
-    (void)component;
-    Assert(component == 0, ExcIndexRange(component, 0, 1));
+// @sect3{Implementation of the <code>WaveEquation</code> class}
+
+// The implementation of the actual logic is actually fairly short, since we
+// relegate things like assembling the matrices and right hand side vectors
+// to the library. The rest boils down to not much more than 130 lines of
+// actual code, a significant fraction of which is boilerplate code that can
+// be taken from previous example programs (e.g. the functions that solve
+// linear systems, or that generate output).
+//
+// Let's start with the constructor (for an explanation of the choice of
+// time step, see the section on Courant, Friedrichs, and Lewy in the
+// introduction). The finite element, the mapping, and the quadrature
+// formulas depend on the shape of the cells: on quadrilaterals, we use
+// FE_Q elements with a bilinear mapping and tensor product quadrature,
+// and on simplices FE_SimplexP elements with the corresponding linear
+// mapping MappingFE and simplex quadrature formulas. All functions below
+// only use these objects through the base class interfaces, so the rest of
+// the program does not need to know which kind of cells it works on:
+template <int dim>
+WaveEquation<dim>::WaveEquation(const Parameters &parameters)
+    : parameters(parameters),
+      Th(parameters.preconditioner ==
+                 Parameters::PreconditionerType::multigrid
+             ? Triangulation<dim>::limit_level_difference_at_vertices
+             : Triangulation<dim>::none),
+      quadrature_1d(
+          parameters.spectral_elements
+              ? Quadrature<1>(QGaussLobatto<1>(parameters.fe_degree + 1))
+              : Quadrature<1>(QGauss<1>(parameters.fe_degree + 1))),
+      dof_handler(Th), recycling_cg_u(parameters.deflation_space_dimension),
+      total_iterations_u(0), total_iterations_v(0), total_solve_time_u(0),
+      total_solve_time_v(0),
+      forcing_term_timestep_number(numbers::invalid_unsigned_int),
+      forcing_is_zero(false), lts_increment_valid(false),
+      time_step(1. / 64), time(time_step), timestep_number(1),
+      theta(0.5 + 50 * time_step) {
+  if (parameters.simplex_mesh) {
+    fe = std::make_unique<FE_SimplexP<dim>>(parameters.fe_degree);
+    mapping = std::make_unique<MappingFE<dim>>(FE_SimplexP<dim>(1));
+    quadrature = QGaussSimplex<dim>(parameters.fe_degree + 1);
+    face_quadrature = QGaussSimplex<dim - 1>(parameters.fe_degree + 1);
+  } else {
+    fe = std::make_unique<FE_Q<dim>>(
+        QGaussLobatto<1>(parameters.fe_degree + 1));
+    mapping = std::make_unique<MappingQ1<dim>>();
+    quadrature = Quadrature<dim>(quadrature_1d);
+    face_quadrature = QGauss<dim - 1>(parameters.fe_degree + 1);
+  }
+}
+
+// @sect4{WaveEquation::setup_system}
+
+// The next function is the one that sets up the DoFHandler, and
+// matrices and vectors at the beginning of the program, i.e. before the
+// first time step. The first few lines are pretty much standard if you've
+// read through the tutorial programs at least up to step-6:
+template <int dim> void WaveEquation<dim>::setup_system() {
+
+  dof_handler.distribute_dofs(*fe);
+  if (parameters.preconditioner == Parameters::PreconditionerType::multigrid)
+    dof_handler.distribute_mg_dofs();
+
+  // DoFHandler::distribute_dofs numbers the degrees of freedom cell by cell
+  // in the order in which the cells are stored, and after a few rounds of
+  // adaptive refinement, the children of a cell are stored far away from
+  // their neighbors. Entries of the vectors that are coupled by the
+  // matrices then end up far apart in memory, and the matrix-vector
+  // products of the time loop miss the cache. We therefore renumber the
+  // degrees of freedom on every new mesh if so requested. The
+  // Cuthill-McKee orderings take the hanging node constraints into account,
+  // since these are part of the couplings of the condensed matrices:
+  switch (parameters.dof_ordering) {
+  case Parameters::DoFOrdering::none:
+    break;
+  case Parameters::DoFOrdering::cuthill_mckee:
+    DoFRenumbering::Cuthill_McKee(dof_handler, /*reversed_numbering = */ false,
+                                  /*use_constraints = */ true);
+    break;
+  case Parameters::DoFOrdering::reverse_cuthill_mckee:
+    DoFRenumbering::Cuthill_McKee(dof_handler, /*reversed_numbering = */ true,
+                                  /*use_constraints = */ true);
+    break;
+  case Parameters::DoFOrdering::hierarchical:
+    DoFRenumbering::hierarchical(dof_handler);
+    break;
+  default:
+    Assert(false, ExcNotImplemented());
+  }
+
+  std::cout << std::endl
+            << "===========================================" << std::endl
+            << "Number of active cells: " << triangulation.n_active_cells()
+            << std::endl
+            << "Number of degrees of freedom: " << dof_handler.n_dofs()
+            << std::endl
+            << std::endl;
+
+  // Once the mesh has been adaptively refined, it has hanging nodes, and
+  // the values of the degrees of freedom on them are determined by the ones
+  // on the neighboring coarser cells. We collect these constraints here and
+  // eliminate the constrained degrees of freedom from all linear systems
+  // right when they are assembled, see assemble_matrices():
+  constraints.clear();
+  DoFTools::make_hanging_node_constraints(dof_handler, constraints);
+  constraints.close();
+
+  // Then comes a block where we have to initialize the 3 matrices we need
+  // in the course of the program: the mass matrix, the Laplace matrix, and
+  // the matrix $M+k^2\theta^2A$ used when solving for $U^n$ in each time
+  // step.
+  //
+  // When setting up these matrices, note that they all make use of the same
+  // sparsity pattern object. Finally, the reason why matrices and sparsity
+  // patterns are separate objects in deal.II (unlike in many other finite
+  // element or linear algebra classes) becomes clear: in a significant
+  // fraction of applications, one has to hold several matrices that happen
+  // to have the same sparsity pattern, and there is no reason for them not
+  // to share this information, rather than re-building and wasting memory
+  // on it several times.
+  //
+  // Since the constrained degrees of freedom are eliminated during
+  // assembly, their rows and columns only ever hold a diagonal entry, and
+  // we tell DoFTools::make_sparsity_pattern not to reserve any other
+  // entries for them. On adaptively refined meshes, this makes the
+  // matrices noticeably smaller.
+  //
+  // After initializing all of these matrices, all three of them are built
+  // in one loop over the cells by assemble_matrices(); the matrix
+  // $M+k^2\theta^2A$ for solving for $U^n$ then stays untouched until the
+  // mesh changes again. The explicit schemes do not need it, and with
+  // interleaved storage, it is formed on the fly, so in these cases it is
+  // not built at all.
+  //
+  // None of this is needed if the operators are evaluated matrix-free; the
+  // corresponding setup is done in setup_matrix_free() below, once the
+  // boundary degrees of freedom are known.
+  if (parameters.operator_evaluation ==
+      Parameters::OperatorEvaluation::matrix_based) {
+    DynamicSparsityPattern dsp(dof_handler.n_dofs(), dof_handler.n_dofs());
+    DoFTools::make_sparsity_pattern(dof_handler, dsp, constraints,
+                                    /*keep_constrained_dofs = */ false);
+    sparsity_pattern.copy_from(dsp);
+
+    mass_matrix.reinit(sparsity_pattern);
+    laplace_matrix.reinit(sparsity_pattern);
+    if (parameters.time_stepping_scheme ==
+            Parameters::TimeSteppingScheme::theta &&
+        !parameters.interleaved_storage)
+      matrix_u.reinit(sparsity_pattern);
+    else
+      matrix_u.clear();
+
+    assemble_matrices();
+
+    // The lumped mass matrix is computed from the rows of the consistent
+    // one, see compute_lumped_mass_matrix(). If the $\theta$-scheme uses
+    // it, it replaces the mass matrix in both equations, and so only the
+    // Laplace part of $M_L+k^2\theta^2A$ has been assembled above; we add
+    // the diagonal here, before anything else is built from the matrix:
+    if (parameters.mass_lumping || parameters.time_stepping_scheme !=
+                                       Parameters::TimeSteppingScheme::theta)
+      compute_lumped_mass_matrix();
+    if (parameters.mass_lumping && !matrix_u.empty())
+      for (types::global_dof_index row = 0; row < matrix_u.m(); ++row)
+        matrix_u.diag_element(row) += lumped_mass_matrix(row);
+
+    // Since every copy in the SELL-$C$-$\sigma$ format comes in addition to
+    // the CSR matrix it is made of, we only make the ones whose products are
+    // actually computed: the one of the Laplace matrix for the right hand
+    // sides, the one of the mass matrix only if it is not lumped, and the
+    // one of the matrix for $U^n$ only if that equation is solved with CG.
+    // We report which operators use the format and what it costs:
+    if (parameters.matrix_format == Parameters::MatrixFormat::sell_c_sigma) {
+      const bool theta = (parameters.time_stepping_scheme ==
+                          Parameters::TimeSteppingScheme::theta);
+      laplace_matrix_sell.reinit(laplace_matrix);
+      std::cout << "SELL-C-sigma products: Laplace matrix";
+      if (theta && !parameters.mass_lumping) {
+        mass_matrix_sell.reinit(mass_matrix);
+        std::cout << ", mass matrix";
+      }
+      if (theta && !parameters.direct_solver_u) {
+        matrix_u_sell.reinit(matrix_u);
+        std::cout << ", matrix for U";
+      }
+      std::cout << "; "
+                << laplace_matrix_sell.memory_consumption() +
+                       mass_matrix_sell.memory_consumption() +
+                       matrix_u_sell.memory_consumption()
+                << " bytes in addition to the CSR matrices." << std::endl;
+    }
+    report_matrix_structure();
+  }
+
+  // The degrees of freedom on which we impose Dirichlet values are the same
+  // for all time steps on a given mesh. We collect them once here by
+  // interpolating an arbitrary function on the boundary and keeping the
+  // keys of the resulting map. At the same time, we evaluate the spatial
+  // profiles of the boundary values at their support points, so that the
+  // time loop never has to walk over boundary faces again:
+  {
+    std::map<types::global_dof_index, double> boundary_values;
+    VectorTools::interpolate_boundary_values(*mapping, dof_handler, 0,
+                                             Functions::ZeroFunction<dim>(),
+                                             boundary_values);
+
+    boundary_dofs.clear();
+    boundary_dofs.reserve(boundary_values.size());
+    for (const auto &boundary_value : boundary_values)
+      boundary_dofs.push_back(boundary_value.first);
+
+    std::vector<Point<dim>> support_points(dof_handler.n_dofs());
+    DoFTools::map_dofs_to_support_points(*mapping, dof_handler,
+                                         support_points);
+
+    const BoundaryValuesU<dim> boundary_values_u_function;
+    const BoundaryValuesV<dim> boundary_values_v_function;
+    boundary_profile_u.resize(boundary_dofs.size());
+    boundary_profile_v.resize(boundary_dofs.size());
+    for (unsigned int i = 0; i < boundary_dofs.size(); ++i) {
+      const Point<dim> &p = support_points[boundary_dofs[i]];
+      boundary_profile_u[i] = boundary_values_u_function.spatial_profile(p);
+      boundary_profile_v[i] = boundary_values_v_function.spatial_profile(p);
+    }
+    boundary_values_u.resize(boundary_dofs.size());
+    boundary_values_v.resize(boundary_dofs.size());
+  }
+  // If the column indices are to be compressed, this is done either
+  // within the InterleavedWaveMatrix or, for the right hand side products
+  // with CSR matrices, here. In both cases, the sparsity pattern is still
+  // needed, by the CSR matrices or by the row iterators of the
+  // interleaved matrix combinations, so the compressed indices come in
+  // addition to it; we report both:
+  const auto report_compressed_column_indices =
+      [this](const DeltaCompressedColumnIndices &indices) {
+        std::cout << "Memory for the column indices: "
+                  << sparsity_pattern.memory_consumption()
+                  << " bytes in the sparsity pattern, "
+                  << indices.memory_consumption()
+                  << " bytes compressed (" << indices.n_escapes()
+                  << " escaped entries)." << std::endl
+                  << std::endl;
+      };
+
+  recycling_cg_u.clear();
+  if (parameters.operator_evaluation ==
+      Parameters::OperatorEvaluation::matrix_free)
+    setup_matrix_free();
+  else if (parameters.interleaved_storage) {
+    wave_matrix.reinit(mass_matrix, laplace_matrix,
+                       parameters.compressed_column_indices);
+    if (parameters.compressed_column_indices)
+      report_compressed_column_indices(
+          wave_matrix.get_compressed_column_indices());
+    wave_matrix_u.initialize(wave_matrix, 1.,
+                             theta * theta * time_step * time_step,
+                             parameters.mass_lumping ? &lumped_mass_matrix
+                                                     : nullptr);
+    wave_matrix_v.initialize(wave_matrix, 1., 0.);
+    system_matrix_u_interleaved.initialize(wave_matrix_u, boundary_dofs);
+    system_matrix_v_interleaved.initialize(wave_matrix_v, boundary_dofs);
+  } else if (!parameters.symmetric_storage) {
+    if (parameters.compressed_column_indices) {
+      compressed_column_indices.reinit(sparsity_pattern);
+      report_compressed_column_indices(compressed_column_indices);
+    }
+    if (parameters.time_stepping_scheme ==
+        Parameters::TimeSteppingScheme::theta)
+      system_matrix_u.initialize(matrix_u, boundary_dofs);
+    system_matrix_v.initialize(mass_matrix, boundary_dofs);
+    if (parameters.matrix_format == Parameters::MatrixFormat::sell_c_sigma &&
+        parameters.time_stepping_scheme ==
+            Parameters::TimeSteppingScheme::theta) {
+      if (!parameters.direct_solver_u)
+        system_matrix_u_sell.initialize(matrix_u_sell, boundary_dofs);
+      if (!parameters.mass_lumping)
+        system_matrix_v_sell.initialize(mass_matrix_sell, boundary_dofs);
+    }
+  }
+
+  if (parameters.operator_evaluation ==
+          Parameters::OperatorEvaluation::matrix_based &&
+      parameters.time_stepping_scheme ==
+          Parameters::TimeSteppingScheme::theta &&
+      !parameters.symmetric_storage) {
+    if (parameters.direct_solver_u)
+      factorize_matrix_u();
+    else if (parameters.preconditioner ==
+             Parameters::PreconditionerType::multigrid)
+      setup_multigrid();
+    else if (parameters.mixed_precision) {
+      matrix_u_float.reinit(sparsity_pattern);
+      matrix_u_float.copy_from(matrix_u);
+      system_matrix_u_float.initialize(matrix_u_float, boundary_dofs);
+      preconditioner_u_float.initialize(matrix_u_float,
+                                        parameters.preconditioner);
+    } else if (parameters.interleaved_storage)
+      preconditioner_u_interleaved.initialize(wave_matrix_u,
+                                              parameters.preconditioner);
+    else
+      preconditioner_u.initialize(matrix_u, parameters.preconditioner);
+
+    if (!parameters.mass_lumping) {
+      if (parameters.mixed_precision) {
+        mass_matrix_float.reinit(sparsity_pattern);
+        mass_matrix_float.copy_from(mass_matrix);
+        system_matrix_v_float.initialize(mass_matrix_float, boundary_dofs);
+        preconditioner_v_float.initialize(mass_matrix_float,
+                                          parameters.preconditioner);
+      } else if (parameters.preconditioner ==
+                 Parameters::PreconditionerType::multigrid)
+        preconditioner_v.initialize(mass_matrix,
+                                    Parameters::PreconditionerType::jacobi);
+      else if (parameters.interleaved_storage)
+        preconditioner_v_interleaved.initialize(wave_matrix_v,
+                                                parameters.preconditioner);
+      else
+        preconditioner_v.initialize(mass_matrix, parameters.preconditioner);
+    }
+  }
+
+  // At this point, everything that needs the rows of the full matrices has
+  // been computed. If symmetric storage is requested, we keep only the
+  // upper triangles of all matrices from here on, on the shared symmetric
+  // pattern, and release the full matrices together with their sparsity
+  // pattern. We report the memory actually held by the matrices and
+  // patterns before and after. Only then can the boundary masking and the
+  // preconditioners of the $\theta$-scheme be set up, on the symmetric
+  // matrices:
+  if (parameters.symmetric_storage) {
+    const std::size_t memory_before = mass_matrix.memory_consumption() +
+                                      laplace_matrix.memory_consumption() +
+                                      matrix_u.memory_consumption() +
+                                      sparsity_pattern.memory_consumption();
+
+    sparsity_pattern_symmetric.reinit(sparsity_pattern);
+    mass_matrix_symmetric.reinit(sparsity_pattern_symmetric, mass_matrix);
+    laplace_matrix_symmetric.reinit(sparsity_pattern_symmetric,
+                                    laplace_matrix);
+    if (parameters.time_stepping_scheme ==
+        Parameters::TimeSteppingScheme::theta)
+      matrix_u_symmetric.reinit(sparsity_pattern_symmetric, matrix_u);
+    mass_matrix.clear();
+    laplace_matrix.clear();
+    matrix_u.clear();
+    sparsity_pattern.reinit(0, 0, 0);
+
+    const std::size_t memory_after =
+        sparsity_pattern_symmetric.memory_consumption() +
+        mass_matrix_symmetric.memory_consumption() +
+        laplace_matrix_symmetric.memory_consumption() +
+        matrix_u_symmetric.memory_consumption();
+    std::cout << "Memory for the matrices and their sparsity patterns: "
+              << memory_before << " bytes in full storage, " << memory_after
+              << " bytes in symmetric storage." << std::endl
+              << std::endl;
+
+    if (parameters.time_stepping_scheme ==
+        Parameters::TimeSteppingScheme::theta) {
+      system_matrix_u_symmetric.initialize(matrix_u_symmetric, boundary_dofs);
+      preconditioner_u_symmetric.initialize(matrix_u_symmetric,
+                                            parameters.preconditioner);
+      if (!parameters.mass_lumping) {
+        system_matrix_v_symmetric.initialize(mass_matrix_symmetric,
+                                             boundary_dofs);
+        preconditioner_v_symmetric.initialize(mass_matrix_symmetric,
+                                              parameters.preconditioner);
+      }
+    }
+  }
+
+  // Likewise, with interleaved storage, the separate mass and Laplace
+  // matrices are no longer needed once the interleaved copy and the lumped
+  // mass matrix have been built from them:
+  if (parameters.interleaved_storage) {
+    mass_matrix.clear();
+    laplace_matrix.clear();
+  }
+
+  // The rest of the function is spent on setting vector sizes to the
+  // correct value:
+  solution_u.reinit(dof_handler.n_dofs());
+  solution_v.reinit(dof_handler.n_dofs());
+  old_solution_u.reinit(dof_handler.n_dofs());
+  old_solution_v.reinit(dof_handler.n_dofs());
+  system_rhs.reinit(dof_handler.n_dofs());
+  forcing_term_new.reinit(dof_handler.n_dofs());
+  forcing_term_old.reinit(dof_handler.n_dofs());
+  forcing_terms.reinit(dof_handler.n_dofs());
+  forcing_term_timestep_number = numbers::invalid_unsigned_int;
+  tmp.reinit(dof_handler.n_dofs());
+  mass_times_old_u.reinit(dof_handler.n_dofs());
+  mass_times_old_v.reinit(dof_handler.n_dofs());
+  laplace_times_old_u.reinit(dof_handler.n_dofs());
+
+  // For the explicit scheme, the largest stable time step is determined by
+  // the smallest cell of the current mesh. For bilinear elements with a
+  // lumped mass matrix on square cells of side length $h$ it is
+  // $h/\sqrt{d}$, i.e., the cell diameter divided by the space dimension;
+  // higher polynomial degrees reduce it by roughly the square of the
+  // degree. Because the mesh changes in refine_mesh(), so does the time
+  // step:
+  if (parameters.time_stepping_scheme ==
+      Parameters::TimeSteppingScheme::leapfrog) {
+    time_step = parameters.courant_number *
+                GridTools::minimal_cell_diameter(Th, *mapping) /
+                (dim * fe->degree * fe->degree);
+    std::cout << "Time step from CFL condition: " << time_step << std::endl;
+  } else if (parameters.time_stepping_scheme ==
+             Parameters::TimeSteppingScheme::local_leapfrog)
+    setup_local_time_stepping();
+}
+
+// @sect4{WaveEquation::assemble_matrices}
+
+// The mass and Laplace matrices could be built by the library functions
+// MatrixCreator::create_mass_matrix and
+// MatrixCreator::create_laplace_matrix, but each of them walks over all
+// cells, evaluates the shape functions, and writes into the global matrix
+// on its own, and $M+k^2\theta^2A$ then needs two more passes over the
+// matrix entries. Since all of this has to be redone after every mesh
+// refinement, we instead compute the local mass and Laplace matrices
+// together from the same shape function values and gradients, and add
+// them (and their combination for $U^n$) to the three global matrices in
+// one go. (With mass lumping, the matrix for $U^n$ only gets the Laplace
+// part here, and setup_system() adds the lumped mass matrix to its
+// diagonal.) Like the library functions, we use WorkStream to run the cell
+// loop in parallel. Rather than serializing the writes into the global
+// matrices, we color the cells so that no two cells of the same color
+// share a degree of freedom; the local contributions of each color can
+// then be added concurrently. See the documentation of WorkStream and the
+// @ref threads "Parallel computing with multiple processors" module for
+// details.
+//
+// Most cells of our meshes are axis-parallel squares (or cubes), and on a
+// cell $[x_0,x_0+h]^d$ the local mass and Laplace matrices are just the
+// ones of the unit cell scaled by $h^d$ and $h^{d-2}$. We therefore compute
+// these reference matrices once on a unit cell and, for every cell whose
+// vertices are those of such a cube in the standard orientation, only
+// scale them, without any work at quadrature points. All other cells
+// (and all simplex cells) go through FEValues as before.
+//
+// The local contributions are not added to the global matrices directly,
+// but through AffineConstraints::distribute_local_to_global(), which
+// resolves the hanging node constraints on the fly: entries belonging to a
+// constrained degree of freedom are redistributed to the degrees of
+// freedom it is constrained to, and the rows and columns of constrained
+// degrees of freedom only get a positive diagonal entry. The resulting
+// matrices are those of the condensed system, and the solution vectors only
+// need AffineConstraints::distribute() after each solve:
+template <int dim> void WaveEquation<dim>::assemble_matrices() {
+  using CellIterator = typename DoFHandler<dim>::active_cell_iterator;
+
+  struct CopyData {
+    FullMatrix<double> cell_mass_matrix;
+    FullMatrix<double> cell_laplace_matrix;
+    FullMatrix<double> cell_matrix_u;
+    std::vector<types::global_dof_index> local_dof_indices;
+  };
+
+  const double laplace_factor = theta * theta * time_step * time_step;
+  const bool assemble_matrix_u =
+      (parameters.time_stepping_scheme ==
+           Parameters::TimeSteppingScheme::theta &&
+       !parameters.interleaved_storage);
+  const UpdateFlags update_flags =
+      update_values | update_gradients | update_JxW_values;
+  const unsigned int dofs_per_cell = fe->n_dofs_per_cell();
+
+  // The following function computes the local matrices from the shape
+  // functions at the quadrature points of whatever cell the FEValues
+  // object was last initialized with. We use it both for the unit cell and
+  // for general cells:
+  const auto integrate_cell_matrices = [dofs_per_cell](
+                                           const FEValues<dim> &fe_values,
+                                           FullMatrix<double> &mass,
+                                           FullMatrix<double> &laplace) {
+    mass.reinit(dofs_per_cell, dofs_per_cell);
+    laplace.reinit(dofs_per_cell, dofs_per_cell);
+    for (const unsigned int q : fe_values.quadrature_point_indices()) {
+      const double JxW = fe_values.JxW(q);
+      for (unsigned int i = 0; i < dofs_per_cell; ++i) {
+        const double phi_i = fe_values.shape_value(i, q) * JxW;
+        const Tensor<1, dim> grad_phi_i = fe_values.shape_grad(i, q) * JxW;
+        for (unsigned int j = 0; j <= i; ++j) {
+          mass(i, j) += phi_i * fe_values.shape_value(j, q);
+          laplace(i, j) += grad_phi_i * fe_values.shape_grad(j, q);
+        }
+      }
+    }
+
+    for (unsigned int i = 0; i < dofs_per_cell; ++i)
+      for (unsigned int j = i + 1; j < dofs_per_cell; ++j) {
+        mass(i, j) = mass(j, i);
+        laplace(i, j) = laplace(j, i);
+      }
+  };
+
+  // A cell is a cube $[x_0,x_0+h]^d$ in standard orientation if its vertex
+  // $v$ is at $x_0 + h\sum_d b_d(v)\mathbf e_d$, where $b_d(v)$ is the
+  // $d$th bit of $v$ (the vertices of a hypercube cell are numbered
+  // lexicographically). We then return $h$, and zero otherwise:
+  const bool use_reference_matrices = !parameters.simplex_mesh;
+  const auto cube_cell_size = [use_reference_matrices](
+                                  const CellIterator &cell) -> double {
+    if (!use_reference_matrices)
+      return 0;
+
+    const double h = cell->vertex(1)[0] - cell->vertex(0)[0];
+    if (h <= 0)
+      return 0;
+    for (unsigned int v = 1; v < GeometryInfo<dim>::vertices_per_cell; ++v)
+      for (unsigned int d = 0; d < dim; ++d)
+        if (std::abs(cell->vertex(v)[d] - cell->vertex(0)[d] -
+                     ((v >> d) & 1) * h) > 1e-12 * h)
+          return 0;
+    return h;
+  };
+
+  FullMatrix<double> reference_mass_matrix, reference_laplace_matrix;
+  if (use_reference_matrices) {
+    Triangulation<dim> unit_cell;
+    GridGenerator::hyper_cube(unit_cell, 0, 1);
+    FEValues<dim> fe_values(*mapping, *fe, quadrature, update_flags);
+    fe_values.reinit(unit_cell.begin_active());
+    integrate_cell_matrices(fe_values, reference_mass_matrix,
+                            reference_laplace_matrix);
+  }
+
+  const auto cell_worker = [&](const CellIterator &cell,
+                               MeshWorker::ScratchData<dim> &scratch_data,
+                               CopyData &copy_data) {
+    copy_data.local_dof_indices.resize(dofs_per_cell);
+    cell->get_dof_indices(copy_data.local_dof_indices);
+
+    const double h = cube_cell_size(cell);
+    if (h > 0) {
+      copy_data.cell_mass_matrix.reinit(dofs_per_cell, dofs_per_cell);
+      copy_data.cell_laplace_matrix.reinit(dofs_per_cell, dofs_per_cell);
+      copy_data.cell_mass_matrix.equ(std::pow(h, dim), reference_mass_matrix);
+      copy_data.cell_laplace_matrix.equ(std::pow(h, dim - 2),
+                                        reference_laplace_matrix);
+    } else
+      integrate_cell_matrices(scratch_data.reinit(cell),
+                              copy_data.cell_mass_matrix,
+                              copy_data.cell_laplace_matrix);
+
+    if (assemble_matrix_u) {
+      if (parameters.mass_lumping)
+        copy_data.cell_matrix_u.reinit(dofs_per_cell, dofs_per_cell);
+      else
+        copy_data.cell_matrix_u = copy_data.cell_mass_matrix;
+      copy_data.cell_matrix_u.add(laplace_factor,
+                                  copy_data.cell_laplace_matrix);
+    }
+  };
+
+  const auto copier = [&](const CopyData &copy_data) {
+    constraints.distribute_local_to_global(
+        copy_data.cell_mass_matrix, copy_data.local_dof_indices, mass_matrix);
+    constraints.distribute_local_to_global(copy_data.cell_laplace_matrix,
+                                           copy_data.local_dof_indices,
+                                           laplace_matrix);
+    if (assemble_matrix_u)
+      constraints.distribute_local_to_global(
+          copy_data.cell_matrix_u, copy_data.local_dof_indices, matrix_u);
+  };
+
+  // Since the copier writes into the rows of the degrees of freedom that
+  // the constrained ones of a cell are constrained to, two cells conflict
+  // not only if they share a degree of freedom, but also if they share one
+  // of these:
+
+  const std::vector<std::vector<CellIterator>> colored_cells =
+      GraphColoring::make_graph_coloring(
+          dof_handler.begin_active(), CellIterator(dof_handler.end()),
+          [this](const CellIterator &cell) {
+            std::vector<types::global_dof_index> local_dof_indices(
+                fe->n_dofs_per_cell());
+            cell->get_dof_indices(local_dof_indices);
+
+            std::vector<types::global_dof_index> conflict_indices =
+                local_dof_indices;
+            for (const auto dof : local_dof_indices)
+              if (constraints.is_constrained(dof))
+                for (const auto &entry :
+                     *constraints.get_constraint_entries(dof))
+                  conflict_indices.push_back(entry.first);
+            return conflict_indices;
+          });
+
+  WorkStream::run(
+      colored_cells, cell_worker, copier,
+      MeshWorker::ScratchData<dim>(*mapping, *fe, quadrature, update_flags),
+      CopyData());
+}
+
+// @sect4{WaveEquation::report_matrix_structure}
+
+// To judge the effect of the ordering of the degrees of freedom, the
+// following function reports two measures of the sparsity pattern: its
+// bandwidth, i.e., the largest distance of an entry from the diagonal, and
+// its profile, the sum over all rows of the distance of the first entry
+// from the diagonal. Both bound how far apart the vector entries are that
+// a matrix-vector product reads for one row. Since what we care about in
+// the end is the speed of these products, we also time a few of them with
+// the Laplace matrix, in each of the storage formats that are in use:
+template <int dim> void WaveEquation<dim>::report_matrix_structure() {
+  std::size_t profile = 0;
+  for (unsigned int row = 0; row < sparsity_pattern.n_rows(); ++row) {
+    types::global_dof_index first_column = row;
+    for (auto p = sparsity_pattern.begin(row); p != sparsity_pattern.end(row);
+         ++p)
+      first_column = std::min(first_column, p->column());
+    profile += row - first_column;
+  }
+
+  Vector<double> src(dof_handler.n_dofs()), dst(dof_handler.n_dofs());
+  src = 1;
+  const unsigned int n_products = 10;
+  const auto time_products = [&](const auto &matrix) {
+    Timer timer;
+    for (unsigned int i = 0; i < n_products; ++i)
+      matrix.vmult(dst, src);
+    timer.stop();
+    return timer.wall_time() / n_products;
+  };
+
+  std::cout << "Matrix bandwidth: " << sparsity_pattern.bandwidth()
+            << ", profile: " << profile << std::endl
+            << "Time per matrix-vector product: "
+            << time_products(laplace_matrix) << " s." << std::endl;
+  if (parameters.matrix_format == Parameters::MatrixFormat::sell_c_sigma)
+    std::cout << "Time per matrix-vector product in SELL-C-sigma format: "
+              << time_products(laplace_matrix_sell) << " s. ("
+              << laplace_matrix_sell.n_stored_entries() << " stored entries "
+              << "for " << laplace_matrix.n_nonzero_elements()
+              << " nonzeros)" << std::endl;
+  std::cout << std::endl;
+}
+
+// @sect4{WaveEquation::compute_lumped_mass_matrix}
+
+// The lumped mass matrix is the diagonal matrix whose entries are the row
+// sums of the consistent mass matrix, i.e., the integrals of the shape
+// functions. Because the support points of FE_Q elements are the
+// Gauss-Lobatto points, these integrals are products of Gauss-Lobatto
+// weights for any polynomial degree, and so they are positive and the
+// inverse is well defined. The explicit schemes need it regardless of
+// what the input file says. This function is called from setup_system()
+// right after the matrices have been assembled, or from
+// setup_matrix_free() once the mass operator is set up. Without a matrix,
+// the row sums are the product of the mass operator with the vector of all
+// ones; the rows of constrained degrees of freedom are zero in this
+// product, and since their values are overwritten by the constraints
+// anyway, we simply put a one there:
+template <int dim> void WaveEquation<dim>::compute_lumped_mass_matrix() {
+  lumped_mass_matrix.reinit(dof_handler.n_dofs());
+  inverse_lumped_mass_matrix.reinit(dof_handler.n_dofs());
+  if (parameters.operator_evaluation ==
+      Parameters::OperatorEvaluation::matrix_free) {
+    Vector<double> ones(dof_handler.n_dofs());
+    ones = 1;
+    matrix_free_mass.apply(lumped_mass_matrix, ones);
+    for (const auto dof : matrix_free->get_constrained_dofs())
+      lumped_mass_matrix(dof) = 1;
+  } else
+    for (unsigned int row = 0; row < mass_matrix.m(); ++row)
+      for (auto p = mass_matrix.begin(row); p != mass_matrix.end(row); ++p)
+        lumped_mass_matrix(row) += p->value();
+
+  for (unsigned int row = 0; row < dof_handler.n_dofs(); ++row) {
+    Assert(lumped_mass_matrix(row) > 0, ExcInternalError());
+    inverse_lumped_mass_matrix(row) = 1. / lumped_mass_matrix(row);
+  }
+}
+
+// @sect4{WaveEquation::setup_matrix_free}
+
+// For the matrix-free evaluation of the operators, we first set up the
+// MatrixFree object that precomputes the data of all cells for the
+// quadrature formula used in the matrix-based code, and with the hanging
+// node constraints of the current mesh. The three operators $M$, $A$, and
+// $M+k^2\theta^2A$ share this object and only differ in the factors in
+// front of the mass and Laplace parts. The mass operator doubles as the
+// matrix of the equation for $V^n$, so we only need preconditioners for
+// two of them (or only one, if the mass matrix is lumped). In the latter
+// case, the operator for $U^n$ is $M_L+k^2\theta^2A$, and it needs the
+// lumped mass matrix, which is in turn computed from the mass operator.
+//
+// The FEEvaluation kernels work on batches of as many cells as fit into
+// the SIMD registers of the machine, see the VectorizedArray class. All
+// cells in a batch run through the same instruction stream, and if they
+// also share their geometry, the MatrixFree class stores the Jacobian only
+// once for the whole batch. On our meshes, all cells of one refinement
+// level are squares (or cubes) of the same size, so we put cells into
+// batches by their refinement level, and make this grouping strict so that
+// no batch mixes cells of different levels:
+template <int dim> void WaveEquation<dim>::setup_matrix_free() {
+  typename MatrixFree<dim, double>::AdditionalData additional_data;
+  additional_data.mapping_update_flags =
+      update_values | update_gradients | update_JxW_values;
+  additional_data.cell_vectorization_category.resize(Th.n_active_cells());
+  for (const auto &cell : Th.active_cell_iterators())
+    additional_data.cell_vectorization_category[cell->active_cell_index()] =
+        cell->level();
+  additional_data.cell_vectorization_categories_strict = true;
+
+  matrix_free = std::make_shared<MatrixFree<dim, double>>();
+  matrix_free->reinit(*mapping, dof_handler, constraints, quadrature_1d,
+                      additional_data);
+
+  unsigned int n_partial_batches = 0;
+  for (unsigned int batch = 0; batch < matrix_free->n_cell_batches(); ++batch)
+    if (matrix_free->n_active_entries_per_cell_batch(batch) <
+        VectorizedArray<double>::size())
+      ++n_partial_batches;
+  std::cout << "Matrix-free operators: " << matrix_free->n_cell_batches()
+            << " batches of " << VectorizedArray<double>::size()
+            << " cells, " << n_partial_batches << " of them partially filled"
+            << std::endl;
+
+  matrix_free_mass.initialize(matrix_free, boundary_dofs, 1., 0.);
+  matrix_free_laplace.initialize(matrix_free, boundary_dofs, 0., 1.);
+  if (parameters.mass_lumping) {
+    compute_lumped_mass_matrix();
+    matrix_free_u.initialize(matrix_free, boundary_dofs, 1.,
+                             theta * theta * time_step * time_step,
+                             &lumped_mass_matrix);
+  } else
+    matrix_free_u.initialize(matrix_free, boundary_dofs, 1.,
+                             theta * theta * time_step * time_step);
+
+  matrix_free_preconditioner_u.initialize(matrix_free_u,
+                                          parameters.preconditioner);
+  if (!parameters.mass_lumping)
+    matrix_free_preconditioner_v.initialize(matrix_free_mass,
+                                            parameters.preconditioner);
+}
+
+// @sect4{WaveEquation::setup_multigrid}
+
+// The mesh <code>Th</code> is obtained from the coarse
+// <code>triangulation</code> by global and then adaptive refinement, and it
+// keeps all of these levels. This is exactly the hierarchy a geometric
+// multigrid method needs, and the following function sets up a V-cycle
+// preconditioner for the matrix $M+k^2\theta^2A$ on it. It follows step-16
+// closely: on adaptively refined meshes, the smoother only works on the
+// cells of each level ("local smoothing"), and the coupling across the
+// refinement edges between levels is taken into account through the
+// interface matrices. Dirichlet boundary degrees of freedom are eliminated
+// on all levels, consistent with the way <code>system_matrix_u</code>
+// treats them on the active level. If the mass matrix is lumped, so is the
+// mass part of the level matrices: we add the row sums of the cell mass
+// matrices to their diagonals, which gives the row sums of the level mass
+// matrix since the level meshes have no hanging nodes.
+//
+// Since the level matrices depend on the mesh and the (fixed) time step
+// only, this function is called from setup_system(), i.e., once at the
+// beginning and then again after every call to refine_mesh(). Before we
+// touch the level matrices, we have to release all objects that point to
+// them.
+template <int dim> void WaveEquation<dim>::setup_multigrid() {
+  mg_preconditioner.reset();
+  mg.reset();
+  mg_matrix.reset();
+  mg_interface_up.reset();
+  mg_interface_down.reset();
+  mg_smoother.reset();
+  mg_coarse_solver.reset();
+  mg_transfer.reset();
+
+  mg_constrained_dofs.clear();
+  mg_constrained_dofs.initialize(dof_handler);
+  mg_constrained_dofs.make_zero_boundary_constraints(dof_handler, {0});
+
+  const unsigned int n_levels = Th.n_levels();
 
-    if ((this->get_time() <= 0.5) && (p[0] < 0) && (p[1] < 1. / 3) &&
-        (p[1] > -1. / 3))
-      return std::sin(this->get_time() * 4 * numbers::PI);
-    else
-      return 0;
-  }
-};
+  mg_interface_matrices.resize(0, n_levels - 1);
+  mg_matrices.resize(0, n_levels - 1);
+  mg_sparsity_patterns.resize(0, n_levels - 1);
 
-template <int dim> class BoundaryValuesV : public Function<dim> {
-public:
-  virtual double value(const Point<dim> &p,
-                       const unsigned int component = 0) const override {
-    (void)component;
-    Assert(component == 0, ExcIndexRange(component, 0, 1));
+  for (unsigned int level = 0; level < n_levels; ++level) {
+    DynamicSparsityPattern dsp(dof_handler.n_dofs(level),
+                               dof_handler.n_dofs(level));
+    MGTools::make_sparsity_pattern(dof_handler, dsp, level);
 
-    if ((this->get_time() <= 0.5) && (p[0] < 0) && (p[1] < 1. / 3) &&
-        (p[1] > -1. / 3))
-      return (std::cos(this->get_time() * 4 * numbers::PI) * 4 * numbers::PI);
-    else
-      return 0;
+    mg_sparsity_patterns[level].copy_from(dsp);
+    mg_matrices[level].reinit(mg_sparsity_patterns[level]);
+    mg_interface_matrices[level].reinit(mg_sparsity_patterns[level]);
   }
-};
 
-// @sect3{Implementation of the <code>WaveEquation</code> class}
+  // The level matrices are assembled by hand in a loop over all cells of
+  // all levels. Degrees of freedom on the boundary and on the refinement
+  // edge are eliminated from the level matrices through one constraints
+  // object per level, and the entries that couple refinement-edge degrees
+  // of freedom to the interior of a level go into the interface matrices:
+  std::vector<AffineConstraints<double>> boundary_constraints(n_levels);
+  for (unsigned int level = 0; level < n_levels; ++level) {
+    boundary_constraints[level].add_lines(
+        mg_constrained_dofs.get_refinement_edge_indices(level));
+    boundary_constraints[level].add_lines(
+        mg_constrained_dofs.get_boundary_indices(level));
+    boundary_constraints[level].close();
+  }
 
-// The implementation of the actual logic is actually fairly short, since we
-// relegate things like assembling the matrices and right hand side vectors
-// to the library. The rest boils down to not much more than 130 lines of
-// actual code, a significant fraction of which is boilerplate code that can
-// be taken from previous example programs (e.g. the functions that solve
-// linear systems, or that generate output).
-//
-// Let's start with the constructor (for an explanation of the choice of
-// time step, see the section on Courant, Friedrichs, and Lewy in the
-// introduction):
-template <int dim>
-WaveEquation<dim>::WaveEquation()
-    : fe(1), dof_handler(Th), time_step(1. / 64), time(time_step),
-      timestep_number(1), theta(0.5 + 50 * time_step) {} //
+  FEValues<dim> fe_values(*mapping, *fe, quadrature,
+                          update_values | update_gradients |
+                              update_JxW_values);
 
-// @sect4{WaveEquation::setup_system}
+  const unsigned int dofs_per_cell = fe->n_dofs_per_cell();
+  FullMatrix<double> cell_matrix(dofs_per_cell, dofs_per_cell);
+  std::vector<types::global_dof_index> local_dof_indices(dofs_per_cell);
 
-// The next function is the one that sets up the DoFHandler, and
-// matrices and vectors at the beginning of the program, i.e. before the
-// first time step. The first few lines are pretty much standard if you've
-// read through the tutorial programs at least up to step-6:
-template <int dim> void WaveEquation<dim>::setup_system() {
+  const double laplace_factor = theta * theta * time_step * time_step;
 
-  dof_handler.distribute_dofs(fe);
+  for (const auto &cell : dof_handler.mg_cell_iterators()) {
+    cell_matrix = 0;
+    fe_values.reinit(cell);
 
-  std::cout << std::endl
-            << "===========================================" << std::endl
-            << "Number of active cells: " << triangulation.n_active_cells()
-            << std::endl
-            << "Number of degrees of freedom: " << dof_handler.n_dofs()
-            << std::endl
-            << std::endl;
+    for (const unsigned int q : fe_values.quadrature_point_indices())
+      for (unsigned int i = 0; i < dofs_per_cell; ++i)
+        for (unsigned int j = 0; j < dofs_per_cell; ++j) {
+          const double mass = fe_values.shape_value(i, q) *
+                              fe_values.shape_value(j, q) * fe_values.JxW(q);
+          cell_matrix(i, parameters.mass_lumping ? i : j) += mass;
+          cell_matrix(i, j) += laplace_factor * fe_values.shape_grad(i, q) *
+                               fe_values.shape_grad(j, q) * fe_values.JxW(q);
+        }
 
-  // add for AMR
-  constraints.clear();
-  DoFTools::make_hanging_node_constraints(dof_handler, constraints);
-  constraints.close();
+    cell->get_mg_dof_indices(local_dof_indices);
+    const unsigned int level = cell->level();
 
-  DynamicSparsityPattern dsp(dof_handler.n_dofs(), dof_handler.n_dofs());
-  DoFTools::make_sparsity_pattern(dof_handler, dsp);
-  sparsity_pattern.copy_from(dsp);
+    boundary_constraints[level].distribute_local_to_global(
+        cell_matrix, local_dof_indices, mg_matrices[level]);
 
-  // Then comes a block where we have to initialize the 3 matrices we need
-  // in the course of the program: the mass matrix, the Laplace matrix, and
-  // the matrix $M+k^2\theta^2A$ used when solving for $U^n$ in each time
-  // step.
-  //
-  // When setting up these matrices, note that they all make use of the same
-  // sparsity pattern object. Finally, the reason why matrices and sparsity
-  // patterns are separate objects in deal.II (unlike in many other finite
-  // element or linear algebra classes) becomes clear: in a significant
-  // fraction of applications, one has to hold several matrices that happen
-  // to have the same sparsity pattern, and there is no reason for them not
-  // to share this information, rather than re-building and wasting memory
-  // on it several times.
-  //
-  // After initializing all of these matrices, we call library functions
-  // that build the Laplace and mass matrices. All they need is a DoFHandler
-  // object and a quadrature formula object that is to be used for numerical
-  // integration. Note that in many respects these functions are better than
-  // what we would usually do in application programs, for example because
-  // they automatically parallelize building the matrices if multiple
-  // processors are available in a machine: for more information see the
-  // documentation of WorkStream or the
-  // @ref threads "Parallel computing with multiple processors"
-  // module. The matrices for solving linear systems will be filled in the
-  // run() method because we need to re-apply boundary conditions every time
-  // step.
-  mass_matrix.reinit(sparsity_pattern);
-  laplace_matrix.reinit(sparsity_pattern);
-  matrix_u.reinit(sparsity_pattern);
-  matrix_v.reinit(sparsity_pattern);
-
-  MatrixCreator::create_mass_matrix(dof_handler, QGauss<dim>(fe.degree + 1),
-                                    mass_matrix);
-  MatrixCreator::create_laplace_matrix(dof_handler, QGauss<dim>(fe.degree + 1),
-                                       laplace_matrix);
-  // MatrixCreator::create_mass_matrix(
-  //     dof_handler, QGaussSimplex<dim>(fe.degree + 1), mass_matrix);
-  // MatrixCreator::create_laplace_matrix(
-  //     dof_handler, QGaussSimplex<dim>(fe.degree + 1), laplace_matrix);
+    for (unsigned int i = 0; i < dofs_per_cell; ++i)
+      for (unsigned int j = 0; j < dofs_per_cell; ++j)
+        if (mg_constrained_dofs.is_interface_matrix_entry(
+                level, local_dof_indices[i], local_dof_indices[j]))
+          mg_interface_matrices[level].add(
+              local_dof_indices[i], local_dof_indices[j], cell_matrix(i, j));
+  }
 
-  // The rest of the function is spent on setting vector sizes to the
-  // correct value. The final line closes the hanging node constraints
-  // object. Since we work on a uniformly refined mesh, no constraints exist
-  // or have been computed (i.e. there was no need to call
-  // DoFTools::make_hanging_node_constraints as in other programs), but we
-  // need a constraints object in one place further down below anyway.
-  solution_u.reinit(dof_handler.n_dofs());
-  solution_v.reinit(dof_handler.n_dofs());
-  old_solution_u.reinit(dof_handler.n_dofs());
-  old_solution_v.reinit(dof_handler.n_dofs());
-  system_rhs.reinit(dof_handler.n_dofs());
+  // With the level matrices in place, the rest is the same as in step-16:
+  // transfer operators between the levels, a direct solver on the coarse
+  // level (which here is a single cell), two symmetric SOR sweeps as
+  // smoother, and the edge matrices for the refinement edges.
+  mg_transfer =
+      std::make_unique<MGTransferPrebuilt<Vector<double>>>(mg_constrained_dofs);
+  mg_transfer->build(dof_handler);
+
+  mg_coarse_matrix.copy_from(mg_matrices[0]);
+  mg_coarse_solver =
+      std::make_unique<MGCoarseGridHouseholder<double, Vector<double>>>();
+  mg_coarse_solver->initialize(mg_coarse_matrix);
+
+  mg_smoother = std::make_unique<mg::SmootherRelaxation<
+      PreconditionSOR<SparseMatrix<double>>, Vector<double>>>();
+  mg_smoother->initialize(mg_matrices);
+  mg_smoother->set_steps(2);
+  mg_smoother->set_symmetric(true);
+
+  mg_matrix = std::make_unique<mg::Matrix<Vector<double>>>(mg_matrices);
+  mg_interface_up =
+      std::make_unique<mg::Matrix<Vector<double>>>(mg_interface_matrices);
+  mg_interface_down =
+      std::make_unique<mg::Matrix<Vector<double>>>(mg_interface_matrices);
+
+  mg = std::make_unique<Multigrid<Vector<double>>>(
+      *mg_matrix, *mg_coarse_solver, *mg_transfer, *mg_smoother,
+      *mg_smoother);
+  mg->set_edge_matrices(*mg_interface_down, *mg_interface_up);
 
-  // constraints.close();
+  mg_preconditioner = std::make_unique<
+      PreconditionMG<dim, Vector<double>, MGTransferPrebuilt<Vector<double>>>>(
+      dof_handler, *mg, *mg_transfer);
+
+  std::cout << "Multigrid levels: " << n_levels << std::endl;
 }
 
 // @sect4{WaveEquation::solve_u and WaveEquation::solve_v}
@@ -330,30 +3390,211 @@ template <int dim> void WaveEquation<dim>::setup_system() {
 // previous tutorial programs.
 //
 // One can make little experiments with preconditioners for the two matrices
-// we have to invert. As it turns out, however, for the matrices at hand
-// here, using Jacobi or SSOR preconditioners reduces the number of
-// iterations necessary to solve the linear system slightly, but due to the
-// cost of applying the preconditioner it is no win in terms of run-time. It
-// is not much of a loss either, but let's keep it simple and just do
-// without:
+// we have to invert. For the matrices at hand here, using Jacobi or SSOR
+// preconditioners reduces the number of iterations necessary to solve the
+// linear system slightly, but due to the cost of applying the
+// preconditioner it is not necessarily a win in terms of run-time; as the
+// mesh gets finer, the picture changes. The preconditioner is therefore
+// selected in the input file (the default is to do without), and we report
+// both the number of iterations and the wall time of each solve. Since the
+// systems are the condensed ones, the last thing to do after each solve is
+// to compute the values of the constrained degrees of freedom:
 template <int dim> void WaveEquation<dim>::solve_u() {
-  SolverControl solver_control(1000, 1e-8 * system_rhs.l2_norm());
-  SolverCG<Vector<double>> cg(solver_control);
+  Timer timer;
+  if (parameters.direct_solver_u) {
+    direct_solver_u.vmult(solution_u, system_rhs);
+    constraints.distribute(solution_u);
+    timer.stop();
+
+    total_solve_time_u += timer.wall_time();
+    std::cout << "   u-equation: direct solve, " << timer.wall_time() << " s."
+              << std::endl;
+    return;
+  }
 
-  cg.solve(matrix_u, solution_u, system_rhs, PreconditionIdentity());
+  unsigned int n_iterations;
+  if (parameters.mixed_precision)
+    n_iterations =
+        solve_mixed_precision(system_matrix_u, system_matrix_u_float,
+                              preconditioner_u_float, solution_u, system_rhs);
+  else {
+    SolverControl solver_control(1000, 1e-8 * system_rhs.l2_norm());
+    const auto solve = [&](const auto &matrix, const auto &preconditioner) {
+      if (parameters.deflation_space_dimension > 0)
+        recycling_cg_u.solve(solver_control, matrix, solution_u, system_rhs,
+                             preconditioner);
+      else {
+        SolverCG<Vector<double>> cg(solver_control);
+        cg.solve(matrix, solution_u, system_rhs, preconditioner);
+      }
+    };
+
+    if (parameters.operator_evaluation ==
+        Parameters::OperatorEvaluation::matrix_free)
+      solve(matrix_free_u, matrix_free_preconditioner_u);
+    else if (parameters.interleaved_storage)
+      solve(system_matrix_u_interleaved, preconditioner_u_interleaved);
+    else if (parameters.symmetric_storage)
+      solve(system_matrix_u_symmetric, preconditioner_u_symmetric);
+    else if (parameters.matrix_format ==
+             Parameters::MatrixFormat::sell_c_sigma) {
+      if (parameters.preconditioner ==
+          Parameters::PreconditionerType::multigrid)
+        solve(system_matrix_u_sell, *mg_preconditioner);
+      else
+        solve(system_matrix_u_sell, preconditioner_u);
+    } else if (parameters.preconditioner ==
+               Parameters::PreconditionerType::multigrid)
+      solve(system_matrix_u, *mg_preconditioner);
+    else
+      solve(system_matrix_u, preconditioner_u);
+    n_iterations = solver_control.last_step();
+  }
+  constraints.distribute(solution_u);
+  timer.stop();
 
-  std::cout << "   u-equation: " << solver_control.last_step()
-            << " CG iterations." << std::endl;
+  total_iterations_u += n_iterations;
+  total_solve_time_u += timer.wall_time();
+  std::cout << "   u-equation: " << n_iterations << " CG iterations, "
+            << timer.wall_time() << " s." << std::endl;
 }
 
 template <int dim> void WaveEquation<dim>::solve_v() {
-  SolverControl solver_control(1000, 1e-8 * system_rhs.l2_norm());
-  SolverCG<Vector<double>> cg(solver_control);
+  Timer timer;
+  unsigned int n_iterations;
+  if (parameters.mixed_precision)
+    n_iterations =
+        solve_mixed_precision(system_matrix_v, system_matrix_v_float,
+                              preconditioner_v_float, solution_v, system_rhs);
+  else {
+    SolverControl solver_control(1000, 1e-8 * system_rhs.l2_norm());
+    SolverCG<Vector<double>> cg(solver_control);
+
+    if (parameters.operator_evaluation ==
+        Parameters::OperatorEvaluation::matrix_free)
+      cg.solve(matrix_free_mass, solution_v, system_rhs,
+               matrix_free_preconditioner_v);
+    else if (parameters.interleaved_storage)
+      cg.solve(system_matrix_v_interleaved, solution_v, system_rhs,
+               preconditioner_v_interleaved);
+    else if (parameters.symmetric_storage)
+      cg.solve(system_matrix_v_symmetric, solution_v, system_rhs,
+               preconditioner_v_symmetric);
+    else if (parameters.matrix_format ==
+             Parameters::MatrixFormat::sell_c_sigma)
+      cg.solve(system_matrix_v_sell, solution_v, system_rhs, preconditioner_v);
+    else
+      cg.solve(system_matrix_v, solution_v, system_rhs, preconditioner_v);
+    n_iterations = solver_control.last_step();
+  }
+  constraints.distribute(solution_v);
+  timer.stop();
+
+  total_iterations_v += n_iterations;
+  total_solve_time_v += timer.wall_time();
+  std::cout << "   v-equation: " << n_iterations << " CG iterations, "
+            << timer.wall_time() << " s." << std::endl;
+}
+
+// Since the matrix $M+k^2\theta^2A$ only changes with the mesh, the
+// equation for $U^n$ can also be solved by factoring the matrix once in
+// setup_system() and then only doing forward and backward substitutions in
+// every time step; for the two-dimensional meshes used here, this is much
+// cheaper than the CG iterations. We use the SparseDirectUMFPACK class for
+// this, which implements a multifrontal factorization with a fill-reducing
+// ordering of the unknowns. Since UMFPACK computes an LU rather than a
+// Cholesky factorization, it does not make use of the symmetry of the
+// matrix, but it is always available with deal.II.
+//
+// The factorization is of the matrix with boundary values applied, i.e.,
+// the operator represented by <code>system_matrix_u</code>. We form it
+// explicitly in a temporary copy of <code>matrix_u</code> by zeroing the
+// off-diagonal entries of boundary rows and columns; the copy is no longer
+// needed once UMFPACK has stored the factors:
+template <int dim> void WaveEquation<dim>::factorize_matrix_u() {
+  Timer timer;
+
+  std::vector<bool> is_boundary_dof(dof_handler.n_dofs(), false);
+  for (const auto dof : boundary_dofs)
+    is_boundary_dof[dof] = true;
+
+  SparseMatrix<double> masked_matrix_u(sparsity_pattern);
+  masked_matrix_u.copy_from(matrix_u);
+  for (unsigned int row = 0; row < masked_matrix_u.m(); ++row)
+    for (auto p = masked_matrix_u.begin(row); p != masked_matrix_u.end(row);
+         ++p)
+      if ((is_boundary_dof[row] || is_boundary_dof[p->column()]) &&
+          (p->column() != row))
+        p->value() = 0;
+
+  direct_solver_u.initialize(masked_matrix_u);
+  timer.stop();
+
+  std::cout << "Factorized the matrix for U in " << timer.wall_time() << " s."
+            << std::endl;
+}
+
+// Sparse matrix-vector products are limited by the memory bandwidth, and
+// storing the matrix entries in single precision reduces the data that has
+// to be read per nonzero entry from twelve bytes (an eight byte value and a
+// four byte column index) to eight. The following function exploits this
+// through iterative refinement: the residual $r = b - Ax$ is computed in
+// double precision with the original matrix, the correction equation $Ac=r$
+// is solved approximately by CG in single precision, and the correction is
+// added to the solution, until the residual meets the same tolerance
+// $10^{-8}\|b\|$ as the double precision solver. Since single precision
+// can only resolve relative accuracies of around $10^{-7}$, the inner
+// solver only reduces the residual by four orders of magnitude; two or
+// three outer steps are then typically enough. The residual vanishes in
+// the boundary rows once the boundary values have been set in the
+// solution, but unless the preconditioner is the identity or Jacobi, the
+// inner CG may still produce nonzero corrections there, since the other
+// preconditioners are built from the matrix without boundary rows masked
+// out. We therefore zero the corrections at the boundary degrees of
+// freedom before adding them, so that the boundary values are left
+// untouched. The function returns the total number of inner CG iterations.
+template <int dim>
+unsigned int WaveEquation<dim>::solve_mixed_precision(
+    const BoundaryMaskedMatrix<SparseMatrix<double>> &matrix,
+    const BoundaryMaskedMatrix<SparseMatrix<float>> &matrix_float,
+    const SelectablePreconditioner<float> &preconditioner_float,
+    Vector<double> &solution, const Vector<double> &right_hand_side) const {
+  const double tolerance = 1e-8 * right_hand_side.l2_norm();
+  const unsigned int max_refinement_steps = 20;
 
-  cg.solve(matrix_v, solution_v, system_rhs, PreconditionIdentity());
+  Vector<double> residual(solution.size());
+  Vector<float> residual_float(solution.size());
+  Vector<float> correction_float(solution.size());
 
-  std::cout << "   v-equation: " << solver_control.last_step()
-            << " CG iterations." << std::endl;
+  unsigned int n_iterations = 0;
+  double residual_norm = 0;
+  for (unsigned int step = 0; step <= max_refinement_steps; ++step) {
+    matrix.vmult(residual, solution);
+    residual.sadd(-1., right_hand_side);
+    residual_norm = residual.l2_norm();
+    if (residual_norm <= tolerance)
+      return n_iterations;
+    if (step == max_refinement_steps)
+      break;
+
+    residual_float = residual;
+    correction_float = 0;
+
+    SolverControl solver_control(1000, 1e-4 * residual_norm);
+    SolverCG<Vector<float>> cg(solver_control);
+    cg.solve(matrix_float, correction_float, residual_float,
+             preconditioner_float);
+    n_iterations += solver_control.last_step();
+
+    for (const auto dof : boundary_dofs)
+      correction_float(dof) = 0;
+    for (unsigned int i = 0; i < solution.size(); ++i)
+      solution(i) += correction_float(i);
+  }
+
+  AssertThrow(false, SolverControl::NoConvergence(max_refinement_steps,
+                                                  residual_norm));
+  return n_iterations;
 }
 
 // @sect4{WaveEquation::output_results}
@@ -370,7 +3611,7 @@ template <int dim> void WaveEquation<dim>::output_results() const {
   data_out.add_data_vector(solution_u, "U");
   data_out.add_data_vector(solution_v, "V");
 
-  data_out.build_patches();
+  data_out.build_patches(*mapping, fe->degree);
 
   const std::string filename =
       "solution-" + Utilities::int_to_string(timestep_number, 3) + ".vtu";
@@ -419,28 +3660,50 @@ void WaveEquation<dim>::refine_mesh(const unsigned int min_grid_level,
   std::cout << "Th.n_levels()= " << Th.n_levels() << std::endl;
 
   KellyErrorEstimator<dim>::estimate(
-      dof_handler, QGauss<dim - 1>(fe.degree + 1),
+      *mapping, dof_handler, face_quadrature,
       std::map<types::boundary_id, const Function<dim> *>(), solution_u,
       estimated_error_per_cell);
 
-  GridRefinement::refine_and_coarsen_fixed_fraction(
-      Th, estimated_error_per_cell, 0.6, 0.4);
-
-  // do not refine mesh that is already at the max refinement level
-  if (Th.n_levels() > max_grid_level)
-    for (const auto &cell : Th.active_cell_iterators_on_level(max_grid_level))
-      cell->clear_refine_flag();
-  // do not coarsen mesh that is already at the min refinement level
-  for (const auto &cell : Th.active_cell_iterators_on_level(min_grid_level))
-    cell->clear_coarsen_flag();
-  // These two loops above are slightly different but this is easily
-  // explained. In the first loop, instead of calling
-  // <code>triangulation.end()</code> we may as well have called
-  // <code>triangulation.end_active(max_grid_level)</code>. The two
-  // calls should yield the same iterator since iterators are sorted
-  // by level and there should not be any cells on levels higher than
-  // on level <code>max_grid_level</code>. In fact, this very piece
-  // of code makes sure that this is the case.
+  // The $l_2$ norm of the indicators serves as an estimate of the total
+  // error. We print it on both kinds of meshes, so that runs on
+  // quadrilaterals and on simplices can be compared at equal accuracy:
+  const double estimated_error = estimated_error_per_cell.l2_norm();
+  std::cout << "Estimated error: " << estimated_error << std::endl;
+
+  // The library can refine simplex meshes only globally, as it does not
+  // support hanging nodes on them. We therefore refine all cells, but only
+  // if the estimated error exceeds the threshold given in the input file
+  // and the mesh is not yet at the finest allowed level; simplex meshes
+  // are never coarsened. Everything after the flags are set, including
+  // the transfer of the solution, is the same as for quadrilaterals:
+  if (parameters.simplex_mesh) {
+    if (estimated_error <= parameters.simplex_refinement_threshold ||
+        Th.n_levels() > max_grid_level)
+      return;
+
+    for (const auto &cell : Th.active_cell_iterators())
+      cell->set_refine_flag();
+  } else {
+    GridRefinement::refine_and_coarsen_fixed_fraction(
+        Th, estimated_error_per_cell, 0.6, 0.4);
+
+    // do not refine mesh that is already at the max refinement level
+    if (Th.n_levels() > max_grid_level)
+      for (const auto &cell :
+           Th.active_cell_iterators_on_level(max_grid_level))
+        cell->clear_refine_flag();
+    // do not coarsen mesh that is already at the min refinement level
+    for (const auto &cell : Th.active_cell_iterators_on_level(min_grid_level))
+      cell->clear_coarsen_flag();
+    // These two loops above are slightly different but this is easily
+    // explained. In the first loop, instead of calling
+    // <code>triangulation.end()</code> we may as well have called
+    // <code>triangulation.end_active(max_grid_level)</code>. The two
+    // calls should yield the same iterator since iterators are sorted
+    // by level and there should not be any cells on levels higher than
+    // on level <code>max_grid_level</code>. In fact, this very piece
+    // of code makes sure that this is the case.
+  }
 
   // As part of mesh refinement we need to transfer the solution vectors
   // from the old mesh to the new one. To this end we use the
@@ -468,6 +3731,15 @@ void WaveEquation<dim>::refine_mesh(const unsigned int min_grid_level,
   previous_solution_v = solution_v;
   std::vector<Vector<double>> all_in{previous_solution_u, previous_solution_v};
 
+  // The solutions of previous time steps from which we extrapolate the
+  // starting vectors of the linear solvers have to make it to the new mesh
+  // as well, so we append them to the list of vectors to be transferred:
+  const unsigned int n_history = solution_history_u.size();
+  for (const auto &history_vector : solution_history_u)
+    all_in.push_back(history_vector);
+  for (const auto &history_vector : solution_history_v)
+    all_in.push_back(history_vector);
+
   std::cout << "all_in[0].size()=" << all_in[0].size() << std::endl;
   std::cout << "all_in[1].size()=" << all_in[1].size() << std::endl;
   std::cout << "dof_handler->n_dofs()=" << dof_handler.n_dofs() << std::endl;
@@ -486,9 +3758,9 @@ void WaveEquation<dim>::refine_mesh(const unsigned int min_grid_level,
   Th.execute_coarsening_and_refinement();
   setup_system();
 
-  std::vector<Vector<double>> all_out(2);
-  all_out[0].reinit(solution_u);
-  all_out[1].reinit(solution_v);
+  std::vector<Vector<double>> all_out(all_in.size());
+  for (auto &vector : all_out)
+    vector.reinit(dof_handler.n_dofs());
 
   solution_transfer.interpolate(all_in, all_out);
 
@@ -497,6 +3769,592 @@ void WaveEquation<dim>::refine_mesh(const unsigned int min_grid_level,
 
   constraints.distribute(solution_u);
   constraints.distribute(solution_v);
+
+  for (unsigned int i = 0; i < n_history; ++i) {
+    solution_history_u[i] = all_out[2 + i];
+    solution_history_v[i] = all_out[2 + n_history + i];
+    constraints.distribute(solution_history_u[i]);
+    constraints.distribute(solution_history_v[i]);
+  }
+}
+
+// @sect4{WaveEquation::assemble_forcing_terms}
+
+// All time integrators need the forcing term $F$ at the beginning and the
+// end of the current time step. The following function provides the
+// integrals $(f^n,\phi_i)$ and $(f^{n-1},\phi_i)$ in
+// <code>forcing_term_new</code> and <code>forcing_term_old</code>.
+//
+// There are two shortcuts. First, if the right hand side function is
+// identically zero, then so are both vectors, and we neither integrate
+// anything nor, in the callers, add the vectors to anything; the flag
+// <code>forcing_is_zero</code> tells them. Second, $F^{n-1}$ is what we
+// computed as $F^n$ in the previous time step, unless the mesh has changed
+// in between or the time iteration has been restarted. We record the time
+// step number for which <code>forcing_term_new</code> was computed (it is
+// reset in setup_system()), and if it is the previous one we just swap the
+// two vectors, so that there is only one integration per time step.
+//
+// The one thing to realize here is how we communicate the time variable
+// to the object describing the right hand side: each object derived from
+// the Function class has a time field that can be set using the
+// Function::set_time and read by Function::get_time. In essence, using
+// this mechanism, all functions of space and time are therefore
+// considered functions of space evaluated at a particular time. This
+// matches well what we typically need in finite element programs, where
+// we almost always work on a single time step at a time, and where it
+// never happens that, for example, one would like to evaluate a
+// space-time function for all times at any given spatial location.
+//
+// Like the matrices, the forcing vectors are condensed, i.e., the entries
+// of constrained degrees of freedom are moved to the ones they are
+// constrained to:
+template <int dim> void WaveEquation<dim>::assemble_forcing_terms() {
+  RightHandSide<dim> rhs_function;
+
+  forcing_is_zero = rhs_function.is_identically_zero();
+  if (forcing_is_zero)
+    return;
+
+  if (forcing_term_timestep_number + 1 == timestep_number)
+    forcing_term_old.swap(forcing_term_new);
+  else {
+    rhs_function.set_time(time - time_step);
+    VectorTools::create_right_hand_side(*mapping, dof_handler, quadrature,
+                                        rhs_function, forcing_term_old);
+    constraints.condense(forcing_term_old);
+  }
+
+  rhs_function.set_time(time);
+  VectorTools::create_right_hand_side(*mapping, dof_handler, quadrature,
+                                      rhs_function, forcing_term_new);
+  constraints.condense(forcing_term_new);
+  forcing_term_timestep_number = timestep_number;
+}
+
+// @sect4{WaveEquation::compute_boundary_values}
+
+// Because the boundary values are separable in space and time, their
+// values at the boundary degrees of freedom at the current time are just
+// the spatial profiles computed in setup_system() times one scalar per
+// function. The loops below are trivially vectorizable:
+template <int dim> void WaveEquation<dim>::compute_boundary_values() {
+  const double time_factor_u = BoundaryValuesU<dim>().time_profile(time);
+  const double time_factor_v = BoundaryValuesV<dim>().time_profile(time);
+
+  const unsigned int n_boundary_dofs = boundary_dofs.size();
+  for (unsigned int i = 0; i < n_boundary_dofs; ++i)
+    boundary_values_u[i] = time_factor_u * boundary_profile_u[i];
+  for (unsigned int i = 0; i < n_boundary_dofs; ++i)
+    boundary_values_v[i] = time_factor_v * boundary_profile_v[i];
+}
+
+// The explicit schemes impose boundary values by simply overwriting the
+// boundary entries of a vector:
+template <int dim>
+void WaveEquation<dim>::set_boundary_values(
+    const std::vector<double> &boundary_values, Vector<double> &vector) const {
+  for (unsigned int i = 0; i < boundary_dofs.size(); ++i)
+    vector(boundary_dofs[i]) = boundary_values[i];
+}
+
+// @sect4{WaveEquation::update_solution_history and WaveEquation::extrapolate_from_history}
+
+// For smooth wave propagation, the solution changes little and smoothly
+// from one time step to the next, and a polynomial extrapolation of the
+// previous solutions is a much better starting vector for CG than just the
+// previous solution. With $p+1$ previous solutions $U^{n-1},\ldots,U^{n-p-1}$,
+// the extrapolation of order $p$ is $\sum_{j=0}^{p} (-1)^j
+// \binom{p+1}{j+1} U^{n-1-j}$, i.e., $U^{n-1}$ for $p=0$, $2U^{n-1} -
+// U^{n-2}$ for $p=1$, $3U^{n-1}-3U^{n-2}+U^{n-3}$ for $p=2$, and so on.
+// The first of the following functions records the solution at the end of
+// each time step, keeping only as many as the extrapolation needs; the
+// second one computes the extrapolation, reducing the order as long as not
+// enough solutions are available yet (after the start of the time
+// iteration).
+template <int dim> void WaveEquation<dim>::update_solution_history() {
+  if (parameters.extrapolation_order == 0)
+    return;
+
+  solution_history_u.push_front(solution_u);
+  solution_history_v.push_front(solution_v);
+  while (solution_history_u.size() > parameters.extrapolation_order + 1) {
+    solution_history_u.pop_back();
+    solution_history_v.pop_back();
+  }
+}
+
+template <int dim>
+void WaveEquation<dim>::extrapolate_from_history(
+    const std::deque<Vector<double>> &history,
+    Vector<double> &prediction) const {
+  if (history.empty())
+    return;
+
+  const unsigned int order =
+      std::min<unsigned int>(parameters.extrapolation_order,
+                             history.size() - 1);
+
+  prediction = 0;
+  double binomial = order + 1;
+  for (unsigned int j = 0; j <= order; ++j) {
+    prediction.add((j % 2 == 0 ? 1. : -1.) * binomial, history[j]);
+    binomial = binomial * (order - j) / (j + 2);
+  }
+}
+
+// @sect4{WaveEquation::do_theta_step}
+
+// This function advances the solution by one step of the implicit
+// $\theta$-scheme discussed in the introduction. We first have to
+// solve for $U^n$, using the equation $(M^n + k^2\theta^2 A^n)U^n =$
+// $(M^{n,n-1} - k^2\theta(1-\theta) A^{n,n-1})U^{n-1} + kM^{n,n-1}V^{n-1}
+// +$ $k\theta \left[k \theta F^n + k(1-\theta) F^{n-1} \right]$. Note
+// that we use the same mesh for all time steps, so that $M^n=M^{n,n-1}=M$
+// and $A^n=A^{n,n-1}=A$. What we therefore have to do first is to add up
+// $MU^{n-1} - k^2\theta(1-\theta) AU^{n-1} + kMV^{n-1}$ and the forcing
+// terms, and put the result into the <code>system_rhs</code> vector. The
+// three products with the old solution are computed in one sweep by
+// fused_wave_vmult(), which reads the compressed column indices if they
+// were requested, and are kept around since the right hand side of the
+// second equation needs two of them again. With matrix-free operators,
+// they are simply three separate operator evaluations, each of which only
+// computes the values or the gradients it needs. In the SELL-$C$-$\sigma$
+// format, the products are also done separately, since each of them is
+// already vectorized, and so they are with symmetric storage, where the
+// two matrices no longer share their sparsity pattern.
+//
+// With mass lumping, $M_L$ takes the place of $M$ in both equations, so
+// that the scheme stays the $\theta$-scheme for the semi-discretization
+// with $M_L$. The products with the mass matrix are then only a scaling of
+// the old solution, and the only product left is the one with the
+// Laplace matrix, which we also need for the second equation:
+template <int dim> void WaveEquation<dim>::do_theta_step() {
+  const bool use_matrix_free = (parameters.operator_evaluation ==
+                                Parameters::OperatorEvaluation::matrix_free);
+  const bool use_sell = (parameters.matrix_format ==
+                         Parameters::MatrixFormat::sell_c_sigma);
+  const auto laplace_vmult = [&](Vector<double> &dst,
+                                 const Vector<double> &src) {
+    if (use_matrix_free)
+      matrix_free_laplace.apply(dst, src);
+    else if (use_sell)
+      laplace_matrix_sell.vmult(dst, src);
+    else if (parameters.symmetric_storage)
+      laplace_matrix_symmetric.vmult(dst, src);
+    else if (parameters.interleaved_storage)
+      wave_matrix.vmult(dst, src, 0., 1.);
+    else
+      laplace_matrix.vmult(dst, src);
+  };
+
+  if (parameters.mass_lumping) {
+    mass_times_old_u = old_solution_u;
+    mass_times_old_u.scale(lumped_mass_matrix);
+    mass_times_old_v = old_solution_v;
+    mass_times_old_v.scale(lumped_mass_matrix);
+    laplace_vmult(laplace_times_old_u, old_solution_u);
+  } else if (use_matrix_free) {
+    matrix_free_mass.apply(mass_times_old_u, old_solution_u);
+    matrix_free_mass.apply(mass_times_old_v, old_solution_v);
+    matrix_free_laplace.apply(laplace_times_old_u, old_solution_u);
+  } else if (use_sell) {
+    mass_matrix_sell.vmult(mass_times_old_u, old_solution_u);
+    mass_matrix_sell.vmult(mass_times_old_v, old_solution_v);
+    laplace_matrix_sell.vmult(laplace_times_old_u, old_solution_u);
+  } else if (parameters.symmetric_storage) {
+    mass_matrix_symmetric.vmult(mass_times_old_u, old_solution_u);
+    mass_matrix_symmetric.vmult(mass_times_old_v, old_solution_v);
+    laplace_matrix_symmetric.vmult(laplace_times_old_u, old_solution_u);
+  } else if (parameters.interleaved_storage)
+    wave_matrix.vmult_mass_and_laplace(old_solution_u, old_solution_v,
+                                       mass_times_old_u, mass_times_old_v,
+                                       laplace_times_old_u);
+  else
+    fused_wave_vmult(mass_matrix, laplace_matrix, old_solution_u,
+                     old_solution_v, mass_times_old_u, mass_times_old_v,
+                     laplace_times_old_u,
+                     parameters.compressed_column_indices
+                         ? &compressed_column_indices
+                         : nullptr);
+
+  system_rhs = mass_times_old_u;
+  system_rhs.add(time_step, mass_times_old_v);
+  system_rhs.add(-theta * (1 - theta) * time_step * time_step,
+                 laplace_times_old_u);
+
+  assemble_forcing_terms();
+  if (!forcing_is_zero) {
+    forcing_terms.equ(theta * time_step, forcing_term_new);
+    forcing_terms.add((1 - theta) * time_step, forcing_term_old);
+
+    system_rhs.add(theta * time_step, forcing_terms);
+  }
+
+  // After so constructing the right hand side vector of the first
+  // equation, all we have to do is apply the correct boundary
+  // values. As for the right hand side, this is a space-time function
+  // evaluated at a particular time, which we evaluate at the boundary
+  // nodes and then use the result to apply boundary values.
+  //
+  // The matrix for solve_u() is the same in every time step, and it has
+  // been built once in setup_system(). Since <code>system_matrix_u</code>
+  // eliminates the boundary rows and columns on the fly, all that is left
+  // to do here is to set the boundary values in the solution vector and to
+  // move the contributions of the eliminated columns to the right hand
+  // side. The result is then handed off to the solve_u() function. The
+  // starting vector for CG is extrapolated from the previous solutions
+  // before the boundary values are set in it.
+  //
+  // The products with the condensed matrices leave meaningless entries in
+  // the rows of constrained degrees of freedom of the right hand side,
+  // which are decoupled from the rest of the system and whose solution is
+  // overwritten by AffineConstraints::distribute() anyway. We zero them,
+  // together with the corresponding entries of the starting vector, so
+  // that the solvers and preconditioners do not spend any effort on these
+  // rows, just as with the matrix-free operators:
+  extrapolate_from_history(solution_history_u, solution_u);
+  compute_boundary_values();
+  if (use_matrix_free)
+    matrix_free_u.apply_boundary_values(boundary_values_u, solution_u,
+                                        system_rhs);
+  else if (parameters.interleaved_storage)
+    system_matrix_u_interleaved.apply_boundary_values(boundary_values_u,
+                                                      solution_u, system_rhs);
+  else if (parameters.symmetric_storage)
+    system_matrix_u_symmetric.apply_boundary_values(boundary_values_u,
+                                                    solution_u, system_rhs);
+  else
+    system_matrix_u.apply_boundary_values(boundary_values_u, solution_u,
+                                          system_rhs);
+  constraints.set_zero(system_rhs);
+  constraints.set_zero(solution_u);
+  solve_u();
+
+  // The second step, i.e. solving for $V^n$, works similarly, except
+  // that this time the matrix on the left is the mass matrix (again with
+  // boundary rows masked out on the fly), and the right hand side is
+  // $MV^{n-1} - k\left[ \theta A U^n + (1-\theta) AU^{n-1}\right]$ plus
+  // forcing terms. Boundary values are applied in the same way as before,
+  // except that now we have to use the values of the BoundaryValuesV
+  // class.
+  //
+  // With a lumped mass matrix $M_L$, the equation reads $M_L V^n = M_L
+  // V^{n-1} - k\left[ \theta A U^n + (1-\theta) AU^{n-1}\right]$ plus
+  // forcing terms, so we only assemble the increment and scale it by the
+  // inverse diagonal; the boundary entries are then simply overwritten:
+  laplace_vmult(system_rhs, solution_u);
+  system_rhs *= -theta * time_step;
+
+  if (!parameters.mass_lumping)
+    system_rhs += mass_times_old_v;
+
+  system_rhs.add(-time_step * (1 - theta), laplace_times_old_u);
+
+  if (!forcing_is_zero)
+    system_rhs += forcing_terms;
+
+  if (parameters.mass_lumping) {
+    system_rhs.scale(inverse_lumped_mass_matrix);
+    solution_v = old_solution_v;
+    solution_v += system_rhs;
+    set_boundary_values(boundary_values_v, solution_v);
+    constraints.distribute(solution_v);
+  } else {
+    extrapolate_from_history(solution_history_v, solution_v);
+    if (use_matrix_free)
+      matrix_free_mass.apply_boundary_values(boundary_values_v, solution_v,
+                                             system_rhs);
+    else if (parameters.interleaved_storage)
+      system_matrix_v_interleaved.apply_boundary_values(
+          boundary_values_v, solution_v, system_rhs);
+    else if (parameters.symmetric_storage)
+      system_matrix_v_symmetric.apply_boundary_values(boundary_values_v,
+                                                      solution_v, system_rhs);
+    else
+      system_matrix_v.apply_boundary_values(boundary_values_v, solution_v,
+                                            system_rhs);
+    constraints.set_zero(system_rhs);
+    constraints.set_zero(solution_v);
+    solve_v();
+  }
+}
+
+// @sect4{WaveEquation::do_leapfrog_step}
+
+// The alternative to the $\theta$-scheme is the explicit central
+// difference, or leapfrog, scheme. Written for the pair $U,V$ and with the
+// lumped mass matrix $M_L$ in place of $M$, one step of it reads
+// @f{align*}{
+//   V^{n-1/2} &= V^{n-1} + \frac k2 M_L^{-1}\left[F^{n-1} - AU^{n-1}\right],
+//   \\
+//   U^n &= U^{n-1} + k V^{n-1/2},
+//   \\
+//   V^n &= V^{n-1/2} + \frac k2 M_L^{-1}\left[F^n - AU^n\right].
+// @f}
+// Since $M_L$ is diagonal, a step costs two matrix-vector products with $A$
+// and a few vector updates, but no linear solves. The price to pay is that
+// the scheme is only stable if the time step satisfies the CFL condition;
+// the time step is therefore not fixed for this scheme but recomputed from
+// the mesh in <code>setup_system</code>. Boundary values are imposed by
+// overwriting the boundary entries of $U^n$ and $V^n$, and the values of
+// constrained degrees of freedom by AffineConstraints::distribute().
+template <int dim> void WaveEquation<dim>::do_leapfrog_step() {
+  assemble_forcing_terms();
+
+  const bool use_sell = (parameters.matrix_format ==
+                         Parameters::MatrixFormat::sell_c_sigma);
+  if (use_sell)
+    laplace_matrix_sell.vmult(tmp, old_solution_u);
+  else if (parameters.symmetric_storage)
+    laplace_matrix_symmetric.vmult(tmp, old_solution_u);
+  else
+    laplace_matrix.vmult(tmp, old_solution_u);
+  if (forcing_is_zero)
+    tmp *= -1.;
+  else
+    tmp.sadd(-1., 1., forcing_term_old);
+  tmp.scale(inverse_lumped_mass_matrix);
+  solution_v = old_solution_v;
+  solution_v.add(time_step / 2, tmp);
+
+  solution_u = old_solution_u;
+  solution_u.add(time_step, solution_v);
+
+  compute_boundary_values();
+  set_boundary_values(boundary_values_u, solution_u);
+  constraints.distribute(solution_u);
+
+  if (use_sell)
+    laplace_matrix_sell.vmult(tmp, solution_u);
+  else if (parameters.symmetric_storage)
+    laplace_matrix_symmetric.vmult(tmp, solution_u);
+  else
+    laplace_matrix.vmult(tmp, solution_u);
+  if (forcing_is_zero)
+    tmp *= -1.;
+  else
+    tmp.sadd(-1., 1., forcing_term_new);
+  tmp.scale(inverse_lumped_mass_matrix);
+  solution_v.add(time_step / 2, tmp);
+
+  set_boundary_values(boundary_values_v, solution_v);
+  constraints.distribute(solution_v);
+}
+
+// @sect4{WaveEquation::setup_local_time_stepping}
+
+// With adaptive refinement, the few cells on the finest level dictate the
+// time step of the explicit scheme for the whole mesh, even though most of
+// the cells are several levels coarser. The local time stepping scheme of
+// Diaz and Grote (SIAM J. Sci. Comput., 2009) instead sorts the degrees of
+// freedom into groups: a degree of freedom belongs to group $l$ if the
+// finest cell it touches is $l$ levels finer than the coarsest active cell.
+// Group $l$ is then advanced with time step $k/2^l$, where $k$ is the time
+// step that is stable on the coarsest cells.
+//
+// In addition to the groups themselves, the recursive algorithm in
+// compute_local_increment() needs, for each level $l$, the set of degrees
+// of freedom on which the solution changes during the substeps of that
+// level: all degrees of freedom of groups $l$ and finer, plus their
+// neighbors, whose values enter the matrix-vector products of the finer
+// groups. Boundary degrees of freedom have prescribed values and are never
+// part of a group.
+template <int dim> void WaveEquation<dim>::setup_local_time_stepping() {
+  unsigned int min_level = numbers::invalid_unsigned_int;
+  for (const auto &cell : Th.active_cell_iterators())
+    min_level = std::min(min_level, static_cast<unsigned int>(cell->level()));
+
+  std::vector<unsigned int> dof_group(dof_handler.n_dofs(), 0);
+  std::vector<types::global_dof_index> local_dof_indices(
+      fe->n_dofs_per_cell());
+  double coarse_diameter = std::numeric_limits<double>::max();
+  for (const auto &cell : dof_handler.active_cell_iterators()) {
+    const unsigned int group =
+        static_cast<unsigned int>(cell->level()) - min_level;
+    cell->get_dof_indices(local_dof_indices);
+    for (const auto dof : local_dof_indices)
+      dof_group[dof] = std::max(dof_group[dof], group);
+    coarse_diameter =
+        std::min(coarse_diameter, cell->diameter() * (1U << group));
+  }
+  for (const auto dof : boundary_dofs)
+    dof_group[dof] = numbers::invalid_unsigned_int;
+
+  const unsigned int n_groups = Th.n_levels() - min_level;
+  lts_group_dofs.clear();
+  lts_group_dofs.resize(n_groups);
+  for (types::global_dof_index i = 0; i < dof_handler.n_dofs(); ++i)
+    if (dof_group[i] != numbers::invalid_unsigned_int)
+      lts_group_dofs[dof_group[i]].push_back(i);
+
+  lts_active_dofs.clear();
+  lts_active_dofs.resize(n_groups);
+  std::vector<bool> is_active(dof_handler.n_dofs());
+  for (unsigned int level = 0; level < n_groups; ++level) {
+    std::fill(is_active.begin(), is_active.end(), false);
+    for (unsigned int group = level; group < n_groups; ++group)
+      for (const auto row : lts_group_dofs[group])
+        for (auto p = sparsity_pattern.begin(row);
+             p != sparsity_pattern.end(row); ++p)
+          is_active[p->column()] = true;
+    for (types::global_dof_index i = 0; i < dof_handler.n_dofs(); ++i)
+      if (is_active[i])
+        lts_active_dofs[level].push_back(i);
+  }
+
+  lts_forcing.resize(n_groups);
+  lts_substep_solution.resize(n_groups);
+  lts_substep_increment.resize(n_groups);
+  for (unsigned int level = 0; level < n_groups; ++level) {
+    lts_forcing[level].reinit(dof_handler.n_dofs());
+    lts_substep_solution[level].reinit(dof_handler.n_dofs());
+    lts_substep_increment[level].reinit(dof_handler.n_dofs());
+  }
+  lts_increment.reinit(dof_handler.n_dofs());
+  lts_increment_valid = false;
+
+  // The coarse time step follows from the same CFL estimate as for the
+  // global leapfrog scheme, but evaluated for cells of the coarsest level
+  // (or, equivalently, for finer cells with their diameter scaled up by the
+  // number of substeps they take). To show what this buys us, we compare
+  // the number of matrix rows evaluated per coarse step with what a global
+  // leapfrog scheme at the finest time step would need:
+  time_step = parameters.courant_number * coarse_diameter /
+              (dim * fe->degree * fe->degree);
+
+  std::size_t local_work = 0;
+  std::cout << "Local time stepping with " << n_groups
+            << " groups, coarse time step " << time_step << std::endl;
+  for (unsigned int level = 0; level < n_groups; ++level) {
+    std::cout << "   group " << level << ": " << lts_group_dofs[level].size()
+              << " DoFs, " << (1U << level) << " substeps" << std::endl;
+    local_work += lts_group_dofs[level].size() << level;
+  }
+  const std::size_t global_work =
+      static_cast<std::size_t>(dof_handler.n_dofs()) << (n_groups - 1);
+  std::cout << "   row evaluations per coarse step: " << local_work
+            << " (global time stepping: " << global_work << ")" << std::endl;
+}
+
+// @sect4{WaveEquation::compute_local_increment}
+
+// The leapfrog scheme for $U'' = f - BU$, with $B=M_L^{-1}A$ and
+// $f=M_L^{-1}F$, can be written as $U^{n+1} - 2U^n + U^{n-1} = 2d$ where
+// $d=\frac{k^2}{2}(f - BU^n)$ is the change over one time step of the
+// solution $y$ of $y''=f-BU^n$, $y(0)=U^n$, $y'(0)=0$. The local time
+// stepping scheme replaces $d$ by the increment of $y'' = f - By$ computed
+// with smaller steps where the mesh is fine. The following function does
+// this recursively: on level $l$, the part of the operator that acts on
+// group $l$ is frozen and added to the forcing, $g = f - (P_l -
+// P_{l+1})Bz$, where $P_l$ is the projection onto the groups $l$ and finer;
+// then two steps of size $\tau/2$ are taken for $y'' = g - P_{l+1}By$, each
+// of which in turn calls this function on level $l+1$. On the finest level
+// there is nothing left to split and $d = \frac{\tau^2}{2}g$.
+//
+// Degrees of freedom that are not active on level $l+1$ only feel the
+// constant forcing $g$ during the substeps, so their increment
+// $\frac{(\tau/2)^2}{2}g$ is set before descending; the recursive call then
+// overwrites the active entries. All vector operations are restricted to
+// the active degrees of freedom of the current level, and the products
+// with $A$ to the rows of the current group, so that the total work per
+// coarse step is proportional to $\sum_l 2^l$ times the size of group $l$.
+template <int dim>
+void WaveEquation<dim>::compute_local_increment(const unsigned int level,
+                                                const Vector<double> &z,
+                                                const Vector<double> &f,
+                                                const double tau,
+                                                Vector<double> &increment) {
+  const std::vector<types::global_dof_index> &active = lts_active_dofs[level];
+
+  Vector<double> &g = lts_forcing[level];
+  for (const auto i : active)
+    g(i) = f(i);
+  for (const auto row : lts_group_dofs[level]) {
+    double laplace_times_z = 0;
+    for (auto p = laplace_matrix.begin(row); p != laplace_matrix.end(row); ++p)
+      laplace_times_z += p->value() * z(p->column());
+    g(row) -= inverse_lumped_mass_matrix(row) * laplace_times_z;
+  }
+
+  if (level + 1 == lts_group_dofs.size()) {
+    for (const auto i : active)
+      increment(i) = tau * tau / 2 * g(i);
+    return;
+  }
+
+  const double sub_tau = tau / 2;
+  Vector<double> &y = lts_substep_solution[level];
+  Vector<double> &e = lts_substep_increment[level];
+
+  for (const auto i : active)
+    e(i) = sub_tau * sub_tau / 2 * g(i);
+  compute_local_increment(level + 1, z, g, sub_tau, e);
+  for (const auto i : active) {
+    y(i) = z(i) + e(i);
+    increment(i) = 2 * e(i);
+  }
+
+  for (const auto i : active)
+    e(i) = sub_tau * sub_tau / 2 * g(i);
+  compute_local_increment(level + 1, y, g, sub_tau, e);
+  for (const auto i : active)
+    increment(i) += 2 * e(i);
+}
+
+// The increment over a full coarse step starts the recursion on level zero,
+// on which all degrees of freedom are active. The boundary entries of the
+// scaled forcing are zeroed, so that the boundary values stay fixed during
+// all substeps:
+template <int dim>
+void WaveEquation<dim>::compute_local_leapfrog_increment(
+    const Vector<double> &u, const Vector<double> &forcing,
+    Vector<double> &increment) {
+  if (forcing_is_zero)
+    tmp = 0;
+  else {
+    tmp = forcing;
+    tmp.scale(inverse_lumped_mass_matrix);
+    for (const auto dof : boundary_dofs)
+      tmp(dof) = 0;
+  }
+
+  compute_local_increment(0, u, tmp, time_step, increment);
+}
+
+// @sect4{WaveEquation::do_local_leapfrog_step}
+
+// In terms of $U$ and $V$, the increment $d$ defines the two half-step
+// updates of the velocity, $V^{n-1/2} = V^{n-1} + d^{n-1}/k$ and $V^n =
+// V^{n-1/2} + d^n/k$, between which $U^n = U^{n-1} + kV^{n-1/2}$. With a
+// single group this is exactly the leapfrog step above. Since the
+// increment at the end of one step is the one needed at the beginning of
+// the next, we keep it around until the mesh changes or the time iteration
+// is restarted:
+template <int dim> void WaveEquation<dim>::do_local_leapfrog_step() {
+  assemble_forcing_terms();
+
+  if (!lts_increment_valid)
+    compute_local_leapfrog_increment(old_solution_u, forcing_term_old,
+                                     lts_increment);
+
+  solution_v = old_solution_v;
+  solution_v.add(1. / time_step, lts_increment);
+
+  solution_u = old_solution_u;
+  solution_u.add(time_step, solution_v);
+
+  compute_boundary_values();
+  set_boundary_values(boundary_values_u, solution_u);
+  constraints.distribute(solution_u);
+
+  compute_local_leapfrog_increment(solution_u, forcing_term_new,
+                                   lts_increment);
+  lts_increment_valid = true;
+  solution_v.add(1. / time_step, lts_increment);
+
+  set_boundary_values(boundary_values_v, solution_v);
+  constraints.distribute(solution_v);
 }
 
 // @sect4{WaveEquation::run}
@@ -510,11 +4368,15 @@ void WaveEquation<dim>::refine_mesh(const unsigned int min_grid_level,
 // onto the finite element space described by the DoFHandler object. Can't
 // be any simpler than that:
 template <int dim> void WaveEquation<dim>::run() {
-  const unsigned int initial_global_refinement = 4;       // 2;
-  const unsigned int n_adaptive_pre_refinement_steps = 4; // 4;
+  const unsigned int initial_global_refinement =
+      parameters.initial_global_refinement;
+  const unsigned int n_adaptive_pre_refinement_steps =
+      parameters.n_adaptive_pre_refinement_steps;
   GridGenerator::hyper_cube(triangulation, -1, 1);
-  // GridGenerator::convert_hypercube_to_simplex_mesh(triangulation, Th);
-  Th.copy_triangulation(triangulation);
+  if (parameters.simplex_mesh)
+    GridGenerator::convert_hypercube_to_simplex_mesh(triangulation, Th);
+  else
+    Th.copy_triangulation(triangulation);
   Th.refine_global(initial_global_refinement);
   std::cout << "Th.n_levels()=" << Th.n_levels() << std::endl;
   std::cout << "triangulation.n_levels()=" << triangulation.n_levels()
@@ -527,163 +4389,89 @@ template <int dim> void WaveEquation<dim>::run() {
   unsigned int pre_refinement_step = 0;
 
   // The next thing is to loop over all the time steps until we reach the
-  // end time ($T=5$ in this case). In each time step, we first have to
-  // solve for $U^n$, using the equation $(M^n + k^2\theta^2 A^n)U^n =$
-  // $(M^{n,n-1} - k^2\theta(1-\theta) A^{n,n-1})U^{n-1} + kM^{n,n-1}V^{n-1}
-  // +$ $k\theta \left[k \theta F^n + k(1-\theta) F^{n-1} \right]$. Note
-  // that we use the same mesh for all time steps, so that $M^n=M^{n,n-1}=M$
-  // and $A^n=A^{n,n-1}=A$. What we therefore have to do first is to add up
-  // $MU^{n-1} - k^2\theta(1-\theta) AU^{n-1} + kMV^{n-1}$ and the forcing
-  // terms, and put the result into the <code>system_rhs</code> vector. (For
-  // these additions, we need a temporary vector that we declare before the
-  // loop to avoid repeated memory allocations in each time step.)
-  //
-  // The one thing to realize here is how we communicate the time variable
-  // to the object describing the right hand side: each object derived from
-  // the Function class has a time field that can be set using the
-  // Function::set_time and read by Function::get_time. In essence, using
-  // this mechanism, all functions of space and time are therefore
-  // considered functions of space evaluated at a particular time. This
-  // matches well what we typically need in finite element programs, where
-  // we almost always work on a single time step at a time, and where it
-  // never happens that, for example, one would like to evaluate a
-  // space-time function for all times at any given spatial location.
-  Vector<double> tmp;
-  Vector<double> forcing_terms;
-
+  // end time ($T=5$ in this case). The work of a single time step is done
+  // by one of the time integrators below, either do_theta_step() or
+  // do_leapfrog_step():
 start_time_iteration:
 
   time = 0.0;
   timestep_number = 0;
+  lts_increment_valid = false;
 
-  tmp.reinit(solution_u.size());
-  forcing_terms.reinit(solution_u.size());
-
-  // VectorTools::project(dof_handler, constraints,
-  //                      QGaussSimplex<dim>(fe.degree + 1),
-  //                      InitialValuesU<dim>(), old_solution_u);
-  // VectorTools::project(dof_handler, constraints,
-  //                      QGaussSimplex<dim>(fe.degree + 1),
-  //                      InitialValuesV<dim>(), old_solution_v);
-
-  VectorTools::interpolate(dof_handler, Functions::ZeroFunction<dim>(),
-                           old_solution_u);
-  VectorTools::interpolate(dof_handler, Functions::ZeroFunction<dim>(),
-                           old_solution_v);
+  VectorTools::interpolate(*mapping, dof_handler,
+                           Functions::ZeroFunction<dim>(), old_solution_u);
+  VectorTools::interpolate(*mapping, dof_handler,
+                           Functions::ZeroFunction<dim>(), old_solution_v);
   solution_u = old_solution_u;
   solution_v = old_solution_v;
 
+  solution_history_u.clear();
+  solution_history_v.clear();
+  update_solution_history();
+
   output_results();
 
+  // Each time step is then delegated to the time integrator selected in the
+  // input file:
   while (time <= 5) {
     time += time_step;
     ++timestep_number;
     std::cout << "Time step " << timestep_number << " at t=" << time
               << std::endl;
 
-    mass_matrix.vmult(system_rhs, old_solution_u);
-
-    mass_matrix.vmult(tmp, old_solution_v);
-    system_rhs.add(time_step, tmp);
-
-    laplace_matrix.vmult(tmp, old_solution_u);
-    system_rhs.add(-theta * (1 - theta) * time_step * time_step, tmp);
-
-    RightHandSide<dim> rhs_function;
-    rhs_function.set_time(time);
-    VectorTools::create_right_hand_side(dof_handler, QGauss<dim>(fe.degree + 1),
-                                        rhs_function, tmp);
-    // VectorTools::create_right_hand_side(
-    //     dof_handler, QGaussSimplex<dim>(fe.degree + 1), rhs_function, tmp);
-    forcing_terms = tmp;
-    forcing_terms *= theta * time_step;
-
-    rhs_function.set_time(time - time_step);
-    VectorTools::create_right_hand_side(dof_handler, QGauss<dim>(fe.degree + 1),
-                                        rhs_function, tmp);
-    // VectorTools::create_right_hand_side(
-    //     dof_handler, QGaussSimplex<dim>(fe.degree + 1), rhs_function, tmp);
-
-    forcing_terms.add((1 - theta) * time_step, tmp);
-
-    system_rhs.add(theta * time_step, forcing_terms);
-
-    // After so constructing the right hand side vector of the first
-    // equation, all we have to do is apply the correct boundary
-    // values. As for the right hand side, this is a space-time function
-    // evaluated at a particular time, which we interpolate at boundary
-    // nodes and then use the result to apply boundary values as we
-    // usually do. The result is then handed off to the solve_u()
-    // function:
-    {
-      BoundaryValuesU<dim> boundary_values_u_function;
-      boundary_values_u_function.set_time(time);
-
-      std::map<types::global_dof_index, double> boundary_values;
-      VectorTools::interpolate_boundary_values(
-          dof_handler, 0, boundary_values_u_function, boundary_values);
-
-      // The matrix for solve_u() is the same in every time steps, so one
-      // could think that it is enough to do this only once at the
-      // beginning of the simulation. However, since we need to apply
-      // boundary values to the linear system (which eliminate some matrix
-      // rows and columns and give contributions to the right hand side),
-      // we have to refill the matrix in every time steps before we
-      // actually apply boundary data. The actual content is very simple:
-      // it is the sum of the mass matrix and a weighted Laplace matrix:
-      matrix_u.copy_from(mass_matrix);
-      matrix_u.add(theta * theta * time_step * time_step, laplace_matrix);
-      MatrixTools::apply_boundary_values(boundary_values, matrix_u, solution_u,
-                                         system_rhs);
-    }
-    solve_u();
-
-    // The second step, i.e. solving for $V^n$, works similarly, except
-    // that this time the matrix on the left is the mass matrix (which we
-    // copy again in order to be able to apply boundary conditions, and
-    // the right hand side is $MV^{n-1} - k\left[ \theta A U^n +
-    // (1-\theta) AU^{n-1}\right]$ plus forcing terms. Boundary values
-    // are applied in the same way as before, except that now we have to
-    // use the BoundaryValuesV class:
-    laplace_matrix.vmult(system_rhs, solution_u);
-    system_rhs *= -theta * time_step;
-
-    mass_matrix.vmult(tmp, old_solution_v);
-    system_rhs += tmp;
-
-    laplace_matrix.vmult(tmp, old_solution_u);
-    system_rhs.add(-time_step * (1 - theta), tmp);
-
-    system_rhs += forcing_terms;
-
-    {
-      BoundaryValuesV<dim> boundary_values_v_function;
-      boundary_values_v_function.set_time(time);
-
-      std::map<types::global_dof_index, double> boundary_values;
-      VectorTools::interpolate_boundary_values(
-          dof_handler, 0, boundary_values_v_function, boundary_values);
-      matrix_v.copy_from(mass_matrix);
-      MatrixTools::apply_boundary_values(boundary_values, matrix_v, solution_v,
-                                         system_rhs);
+    switch (parameters.time_stepping_scheme) {
+    case Parameters::TimeSteppingScheme::theta:
+      do_theta_step();
+      break;
+    case Parameters::TimeSteppingScheme::leapfrog:
+      do_leapfrog_step();
+      break;
+    case Parameters::TimeSteppingScheme::local_leapfrog:
+      do_local_leapfrog_step();
+      break;
+    default:
+      Assert(false, ExcNotImplemented());
     }
-    solve_v();
 
     // Finally, after both solution components have been computed, we
     // output the result, compute the energy in the solution, and go on to
     // the next time step after shifting the present solution into the
     // vectors that hold the solution at the previous time step. Note the
     // function SparseMatrix::matrix_norm_square that can compute
-    // $\left<V^n,MV^n\right>$ and $\left<U^n,AU^n\right>$ in one step,
-    // saving us the expense of a temporary vector and several lines of
-    // code:
+    // $\left<V^n,MV^n\right>$ and $\left<U^n,AU^n\right>$ in one step.
+    // Because the matrices are condensed, the constrained degrees of
+    // freedom only appear on their diagonal and must not contribute, so we
+    // zero them in a temporary copy first. The matrix-free operators have no
+    // such function, but they resolve the constraints themselves:
     output_results();
 
-    std::cout << "   Total energy: "
-              << (mass_matrix.matrix_norm_square(solution_v) +
-                  laplace_matrix.matrix_norm_square(solution_u)) /
-                     2
-              << std::endl;
+    double energy;
+    if (parameters.operator_evaluation ==
+        Parameters::OperatorEvaluation::matrix_free) {
+      matrix_free_mass.apply(tmp, solution_v);
+      energy = solution_v * tmp;
+      matrix_free_laplace.apply(tmp, solution_u);
+      energy += solution_u * tmp;
+    } else {
+      tmp = solution_v;
+      constraints.set_zero(tmp);
+      if (parameters.symmetric_storage)
+        energy = mass_matrix_symmetric.matrix_norm_square(tmp);
+      else if (parameters.interleaved_storage)
+        energy = wave_matrix.matrix_norm_square(tmp, 1., 0.);
+      else
+        energy = mass_matrix.matrix_norm_square(tmp);
+
+      tmp = solution_u;
+      constraints.set_zero(tmp);
+      if (parameters.symmetric_storage)
+        energy += laplace_matrix_symmetric.matrix_norm_square(tmp);
+      else if (parameters.interleaved_storage)
+        energy += wave_matrix.matrix_norm_square(tmp, 0., 1.);
+      else
+        energy += laplace_matrix.matrix_norm_square(tmp);
+    }
+    std::cout << "   Total energy: " << energy / 2 << std::endl;
 
     // ...take care of mesh refinement. Here, what we want to do is
     // (i) refine the requested number of times at the very beginning
@@ -700,9 +4488,6 @@ start_time_iteration:
                   initial_global_refinement + n_adaptive_pre_refinement_steps);
       ++pre_refinement_step;
 
-      tmp.reinit(solution_u.size());
-      forcing_terms.reinit(solution_u.size());
-
       std::cout << std::endl;
 
       std::cout << "timestep_number = " << timestep_number << std::endl;
@@ -712,21 +4497,33 @@ start_time_iteration:
     } else if ((timestep_number > 0) && (timestep_number % 5 == 0)) {
       refine_mesh(initial_global_refinement,
                   initial_global_refinement + n_adaptive_pre_refinement_steps);
-      tmp.reinit(solution_u.size());
-      forcing_terms.reinit(solution_u.size());
     }
 
     old_solution_u = solution_u;
     old_solution_v = solution_v;
+    update_solution_history();
   }
+
+  if (parameters.time_stepping_scheme ==
+      Parameters::TimeSteppingScheme::theta)
+    std::cout << std::endl
+              << "Linear solver statistics:" << std::endl
+              << "   u-equation: " << total_iterations_u
+              << " CG iterations, " << total_solve_time_u << " s"
+              << std::endl
+              << "   v-equation: " << total_iterations_v
+              << " CG iterations, " << total_solve_time_v << " s"
+              << std::endl;
 }
 } // namespace Step23
 
 // @sect3{The <code>main</code> function}
 
 // What remains is the main function of the program. There is nothing here
-// that hasn't been shown in several of the previous programs:
-int main() {
+// that hasn't been shown in several of the previous programs, except that
+// the space dimension is only known once the input file has been read, so
+// we have to pick the instantiation of the WaveEquation class at run time:
+int main(int argc, char *argv[]) {
 
   using std::chrono::duration;
   using std::chrono::duration_cast;
@@ -737,8 +4534,21 @@ int main() {
   try {
     using namespace Step23;
 
-    WaveEquation<2> wave_equation_solver;
-    wave_equation_solver.run();
+    ParameterHandler prm;
+    Parameters::declare_parameters(prm);
+    if (argc > 1)
+      prm.parse_input(argv[1]);
+
+    Parameters parameters;
+    parameters.parse_parameters(prm);
+
+    if (parameters.dimension == 2) {
+      WaveEquation<2> wave_equation_solver(parameters);
+      wave_equation_solver.run();
+    } else {
+      WaveEquation<3> wave_equation_solver(parameters);
+      wave_equation_solver.run();
+    }
   } catch (std::exception &exc) {
     std::cerr << std::endl
               << std::endl